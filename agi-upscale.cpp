@@ -13,7 +13,35 @@
 #include <ctype.h>
 #include <time.h>
 #include <stdint.h>
+#include <assert.h>
 #include <vector>
+#include <memory>
+#include <new>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #include "lodepng.cpp"
 
 #define BASE_WIDTH 160
@@ -23,26 +51,151 @@
 #define UPSCALED_WIDTH 320
 #define UPSCALED_HEIGHT 168
 
+// How many pixels an upscaled fill may spread beyond the area filled in the
+// reference picture. Can be raised for high scale factors with -iterations.
+#define REFERENCE_FILL_ITERATIONS 1
+
+// Hundredths of a second each frame of a -apng animation is shown for
+#define ANIMATION_FRAME_DELAY 4
+
+// Uncomment to count heap allocations for -allocstats. This replaces the
+// global operator new, so it's left out of normal builds.
+//#define AGI_ALLOC_STATS
+
+// How many runs each row of a -rle picture has room for before it needs
+// more memory. Rows keep what they grow to, so this only sets how soon
+// drawing stops allocating.
+#define RLE_ROW_RUNS 160
+
+// How many commands apart -verifyseek and -verifyedit take checkpoints
+#define VERIFY_CHECKPOINT_INTERVAL 16
+
+// Largest width or height -serve will draw a picture at
+#define MAX_SERVE_SIZE 4096
+
+// How many idle drawer pairs are kept for reuse, for -serve requests at
+// different sizes
+#define MAX_IDLE_DRAWERS 4
+
+// Change this when drawing changes, so -cache and -skipunchanged don't
+// keep old images
+#define RENDER_VERSION 2
+
+// Keyword of the tEXt chunk saying how a PNG was drawn
+#define PROVENANCE_KEYWORD "agi-upscale"
+
 typedef unsigned char byte;
 typedef unsigned short int word;
 
+// A horizontal run of pixels in a run length encoded row. Runs are kept in
+// order and each one starts where the previous one ends.
+struct Run
+{
+	unsigned int end;
+	uint8_t colour;
+};
+
+// Pixels start up to but not including end on a single row
+struct Span
+{
+	unsigned int start, end;
+};
+
+// A rectangle of pixels, not including the right and bottom edges
+struct Rect
+{
+	int left, top, right, bottom;
+
+	bool empty() const { return left >= right || top >= bottom; }
+};
+
+static void addPoint(Rect& rect, int x, int y)
+{
+	if (rect.empty())
+	{
+		rect.left = x; rect.top = y; rect.right = x + 1; rect.bottom = y + 1;
+		return;
+	}
+	if (x < rect.left) rect.left = x;
+	if (y < rect.top) rect.top = y;
+	if (x >= rect.right) rect.right = x + 1;
+	if (y >= rect.bottom) rect.bottom = y + 1;
+}
+
+static void unionRect(Rect& rect, const Rect& other)
+{
+	if (other.empty()) return;
+	addPoint(rect, other.left, other.top);
+	addPoint(rect, other.right - 1, other.bottom - 1);
+}
+
+static Rect growRect(const Rect& rect, int margin)
+{
+	Rect grown = { rect.left - margin, rect.top - margin, rect.right + margin, rect.bottom + margin };
+	return grown;
+}
+
+static bool intersects(const Rect& a, const Rect& b)
+{
+	return !a.empty() && !b.empty() && a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom;
+}
+
 struct Bitmap
 {
-	Bitmap(unsigned int inWidth, unsigned int inHeight, uint8_t inClearColour) : width(inWidth), height(inHeight), clearColour(inClearColour)
+	Bitmap(unsigned int inWidth, unsigned int inHeight, uint8_t inClearColour, bool runLength = false) : width(inWidth), height(inHeight), clearColour(inClearColour)
 	{
-		data = new uint8_t[width * height];
-		memset(data, clearColour, width * height);
+		if (runLength)
+		{
+			// Rows are stored as lists of runs, so memory follows the
+			// complexity of the picture rather than its resolution
+			data = nullptr;
+			Run blank = { width, clearColour };
+			rows.resize(height);
+			for (unsigned int y = 0; y < height; y++)
+			{
+				rows[y].reserve(RLE_ROW_RUNS);
+				rows[y].push_back(blank);
+			}
+		}
+		else
+		{
+			data = new uint8_t[width * height];
+			memset(data, clearColour, width * height);
+		}
 	}
 	~Bitmap()
 	{
 		delete[] data;
 	}
 
+	// Sets every pixel back to the clear colour, keeping the memory
+	void Clear()
+	{
+		if (data)
+		{
+			memset(data, clearColour, width * height);
+			return;
+		}
+		Run blank = { width, clearColour };
+		for (unsigned int y = 0; y < height; y++)
+		{
+			rows[y].clear();
+			rows[y].push_back(blank);
+		}
+	}
+
 	void Set(int x, int y, uint8_t col)
 	{
 		if (x >= 0 && y >= 0 && x < width && y < height)
 		{
-			data[y * width + x] = col;
+			if (data)
+			{
+				data[y * width + x] = col;
+			}
+			else
+			{
+				SetRuns(x, x + 1, y, col);
+			}
 		}
 	}
 
@@ -50,97 +203,582 @@ struct Bitmap
 	{
 		if (x >= 0 && y >= 0 && x < width && y < height)
 		{
-			return data[y * width + x];
+			if (data)
+			{
+				return data[y * width + x];
+			}
+			return rows[y][FindRun(x, y)].colour;
 		}
 		return clearColour;
 	}
 
+	// For callers that have already clipped against the bitmap. Debug
+	// builds still assert that the pixel is inside.
+	void SetUnchecked(unsigned int x, unsigned int y, uint8_t col)
+	{
+		assert(x < width && y < height);
+		if (data)
+		{
+			data[y * width + x] = col;
+		}
+		else
+		{
+			SetRuns(x, x + 1, y, col);
+		}
+	}
+
+	uint8_t GetUnchecked(unsigned int x, unsigned int y)
+	{
+		assert(x < width && y < height);
+		if (data)
+		{
+			return data[y * width + x];
+		}
+		return rows[y][FindRun(x, y)].colour;
+	}
+
+	// Sets pixels x1 up to but not including x2 on row y
+	void SetSpan(int x1, int x2, int y, uint8_t col)
+	{
+		if (y < 0 || (unsigned int)y >= height) return;
+		if (x1 < 0) x1 = 0;
+		if (x2 > (int)width) x2 = width;
+		if (x1 >= x2) return;
+
+		if (data)
+		{
+			memset(data + y * width + x1, col, x2 - x1);
+		}
+		else
+		{
+			SetRuns(x1, x2, y, col);
+		}
+	}
+
+	// Returns the pixels of row y, expanding runs into scratch if needed.
+	// scratch must hold at least width pixels.
+	const uint8_t* GetRow(unsigned int y, uint8_t* scratch)
+	{
+		if (data)
+		{
+			return data + y * width;
+		}
+		unsigned int x = 0;
+		for (size_t n = 0; n < rows[y].size(); n++)
+		{
+			memset(scratch + x, rows[y][n].colour, rows[y][n].end - x);
+			x = rows[y][n].end;
+		}
+		return scratch;
+	}
+
+	void SetRow(unsigned int y, const uint8_t* pixels)
+	{
+		if (data)
+		{
+			memcpy(data + y * width, pixels, width);
+			return;
+		}
+		std::vector<Run>& row = rows[y];
+		row.clear();
+		for (unsigned int x = 0; x < width; x++)
+		{
+			if (row.empty() || row.back().colour != pixels[x])
+			{
+				Run run = { x + 1, pixels[x] };
+				row.push_back(run);
+			}
+			else
+			{
+				row.back().end = x + 1;
+			}
+		}
+	}
+
+	void CopyTo(std::vector<uint8_t>& pixels)
+	{
+		pixels.resize(width * height);
+		for (unsigned int y = 0; y < height; y++)
+		{
+			const uint8_t* row = GetRow(y, pixels.data() + y * width);
+			if (row != pixels.data() + y * width)
+			{
+				memcpy(pixels.data() + y * width, row, width);
+			}
+		}
+	}
+
+	void CopyFrom(const std::vector<uint8_t>& pixels)
+	{
+		for (unsigned int y = 0; y < height; y++)
+		{
+			SetRow(y, pixels.data() + y * width);
+		}
+	}
+
+	// Index of the run holding pixel x of row y
+	size_t FindRun(unsigned int x, unsigned int y)
+	{
+		const std::vector<Run>& row = rows[y];
+		size_t low = 0, high = row.size() - 1;
+		while (low < high)
+		{
+			size_t mid = (low + high) / 2;
+			if (row[mid].end > x) high = mid;
+			else low = mid + 1;
+		}
+		return low;
+	}
+
+	// Replaces pixels x1 up to x2 of row y with a single run, merging it
+	// with any neighbouring runs of the same colour
+	void SetRuns(unsigned int x1, unsigned int x2, unsigned int y, uint8_t col)
+	{
+		std::vector<Run>& row = rows[y];
+		size_t first = FindRun(x1, y);
+
+		if (row[first].colour == col && row[first].end >= x2)
+		{
+			return;
+		}
+
+		size_t last = first;
+		while (row[last].end < x2) last++;
+
+		Run pieces[3];
+		int count = 0;
+		unsigned int firstStart = first ? row[first - 1].end : 0;
+		if (firstStart < x1)
+		{
+			pieces[count].end = x1;
+			pieces[count++].colour = row[first].colour;
+		}
+		pieces[count].end = x2;
+		pieces[count++].colour = col;
+		if (row[last].end > x2)
+		{
+			pieces[count].end = row[last].end;
+			pieces[count++].colour = row[last].colour;
+		}
+
+		row.erase(row.begin() + first, row.begin() + last + 1);
+		row.insert(row.begin() + first, pieces, pieces + count);
+
+		size_t from = first ? first - 1 : 0;
+		size_t to = first + count < row.size() ? first + count : row.size() - 1;
+		for (size_t n = to; n > from; n--)
+		{
+			if (row[n].colour == row[n - 1].colour)
+			{
+				row.erase(row.begin() + n - 1);
+			}
+		}
+	}
+
 	unsigned int width, height;
 	uint8_t* data;
 	uint8_t clearColour;
+
+	// Used instead of data by run length encoded bitmaps
+	std::vector<std::vector<Run>> rows;
 };
 
+/**************************************************************************
+** appendRun
+**
+** Adds a run ending at end to row, extending the last run instead if it
+** has the same colour.
+**************************************************************************/
+static inline void appendRun(std::vector<Run>& row, unsigned int end, uint8_t colour)
+{
+	if (!row.empty() && row.back().colour == colour)
+	{
+		row.back().end = end;
+	}
+	else
+	{
+		Run run = { end, colour };
+		row.push_back(run);
+	}
+}
+
 /* QUEUE DEFINITIONS */
 
+// Must be even, as the queue holds x and y pairs
 #define QMAX 8000
-#define EMPTY 0xFFFF
+
+// Flood fill implementations for drawers without a reference drawer
+enum FillEngine
+{
+	FILL_QUEUE,		// The classic queue based fill
+	FILL_BITWISE	// Grows the fill over rows of packed 64 bit words
+};
+
+// Which planes the drawing commands write to, from the F0 to F3 commands
+enum DrawPlanes
+{
+	PLANES_NONE = 0,
+	PLANES_PICTURE = 1,
+	PLANES_PRIORITY = 2,
+	PLANES_BOTH = 3
+};
+
+// How redrawEdited brought a picture up to date
+enum RedrawResult
+{
+	REDRAW_FAILED,	// The edit couldn't be applied, the drawer is unchanged
+	REDRAW_REGION,	// Only the area around the edited command was redrawn
+	REDRAW_FULL		// Everything from the checkpoint before the edit was redrawn
+};
+
+// Ways of writing PNG files
+enum PNGEncoder
+{
+	PNG_LODEPNG,	// RGBA through lodepng
+	PNG_RUNS		// Indexed, deflated straight from colour runs
+};
+
+// How the upscaled priority screen is saved, if at all
+enum PriorityOutput
+{
+	PRIORITY_NONE,
+	PRIORITY_PNG,	// A PNG in the palette colours, with the chosen encoder
+	PRIORITY_RAW	// One byte per pixel holding the priority, row by row
+};
+
+// Totals kept when comparing the fill engines with setVerifyFills
+struct FillStats
+{
+	unsigned verified = 0;
+	unsigned mismatched = 0;
+};
+
+FillStats fillStats;
+
+// Totals kept for the -verifyseek option
+struct SeekStats
+{
+	unsigned verified = 0;
+	unsigned mismatched = 0;
+};
+
+SeekStats seekStats;
+
+// Totals kept for the -verifyedit option
+struct EditStats
+{
+	unsigned verified = 0;
+	unsigned mismatched = 0;
+	unsigned regions = 0;
+};
+
+EditStats editStats;
+
+// Totals kept for the -bench option
+struct DrawStats
+{
+	unsigned long commands = 0;
+	double stepTime = 0;
+	double drawAllTime = 0;
+};
+
+DrawStats drawStats;
+
+// Totals kept for the -allocstats option
+struct AllocStats
+{
+	unsigned pictures = 0;
+	unsigned long drawing = 0;
+	unsigned long afterFirst = 0;
+};
+
+AllocStats allocStats;
+
+// Counted by the operator new below, which is only built in when
+// AGI_ALLOC_STATS is defined, so -allocstats can show how many allocations
+// happen while drawing. Otherwise it stays at 0.
+static unsigned long allocationCount = 0;
+
+#if defined(AGI_ALLOC_STATS)
+void* operator new(size_t size)
+{
+	allocationCount++;
+	void* block = malloc(size ? size : 1);
+	if (!block)
+	{
+		throw std::bad_alloc();
+	}
+	return block;
+}
+
+void operator delete(void* block) noexcept
+{
+	free(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+	free(block);
+}
+#endif
+
+/**************************************************************************
+** Command line options
+**************************************************************************/
+struct Options
+{
+	int fillIterations = REFERENCE_FILL_ITERATIONS;
+	FillEngine fillEngine = FILL_QUEUE;
+	bool verifyFills = false;
+	bool runLength = false;
+	PNGEncoder pngEncoder = PNG_LODEPNG;
+	bool pngStats = false;
+	bool verifyPNG = false;
+	bool verifySeek = false;
+	bool verifyEdit = false;
+	bool bench = false;
+	unsigned int animationInterval = 0;
+	bool allocStats = false;
+	PriorityOutput priorityOutput = PRIORITY_NONE;
+	const char* gameDirectory = nullptr;
+	const char* serveAddress = nullptr;
+	const char* cacheDirectory = nullptr;
+	bool skipUnchanged = false;
+	bool selfTest = false;
+};
+
+Options options;
+
+// Rows of a plane as kept by a checkpoint. Rows that haven't changed since
+// the previous checkpoint share its copy.
+typedef std::vector<std::shared_ptr<const std::vector<uint8_t> > > PlaneRows;
+
+// Drawer state between two commands
+struct Checkpoint
+{
+	unsigned int commandCount;
+	unsigned int offset;
+	bool isDrawing;
+	bool picDrawEnabled, priDrawEnabled;
+	uint8_t picColour, priColour, patCode, patNum;
+	PlaneRows pictureRows, priorityRows;
+};
 
 class PicDrawer
 {
 public:
-	PicDrawer(unsigned int width, unsigned int height);
+	PicDrawer(unsigned int width, unsigned int height, bool runLength = false, bool withPriority = true);
 	~PicDrawer();
 
-	void setReferenceDrawer(PicDrawer* inReferenceDrawer) { referenceDrawer = inReferenceDrawer; }
-	void beginDrawing(uint8_t* inData, unsigned length);
+	void reset();
+	void setReferenceDrawer(PicDrawer* inReferenceDrawer)
+	{
+		referenceDrawer = inReferenceDrawer;
+		// A fill of the whole screen puts every pixel in the frontier, so
+		// room for that is made once here rather than while drawing
+		fillFrontier.reserve(picture->width * picture->height);
+		nextFrontier.reserve(picture->width * picture->height);
+	}
+	void setFillIterations(int inFillIterations) { fillIterations = inFillIterations; }
+	void setFillEngine(FillEngine inFillEngine) { fillEngine = inFillEngine; }
+	void setVerifyFills(bool inVerifyFills) { verifyFills = inVerifyFills; }
+	void beginDrawing(const uint8_t* inData, unsigned length);
 	bool drawStep();
+	void drawAll();
+	unsigned int getCommandCount() { return commandCount; }
+	void enableCheckpoints(unsigned int interval);
+	bool seekToCommand(unsigned int index);
+	RedrawResult redrawEdited(unsigned int index, const uint8_t* inData, unsigned length);
 	void fillGaps();
 
 	Bitmap* getPicture() { return picture; }
+	Bitmap* getPriority() { return priority; }
+	// Area of the planes changed by the last drawStep, seekToCommand,
+	// redrawEdited or fillGaps, in this drawer's coordinates. drawAll adds
+	// to it rather than starting afresh.
+	const Rect& getDirtyRect() { return dirty; }
 
 private:
 	void scaleCoordinates(word& x, word& y);
 	uint8_t getReferencePicture(word x, word y);
 	uint8_t getReferencePriority(word x, word y);
 
-	void qstore(word q);
-	word qretrieve();
-	void pset(word x, word y);
+	void qstore(word x, word y);
+	bool qretrieve(word& x, word& y);
+	// The drawing routines are instantiated for each combination of
+	// enabled planes, so that the choice is made once per command rather
+	// than for every pixel.
+	int drawPlanes() { return (picDrawEnabled ? PLANES_PICTURE : 0) | (priDrawEnabled && priority ? PLANES_PRIORITY : 0); }
+	template <int Planes> void pset(word x, word y);
+	template <int Planes> void psetUnchecked(word x, word y);
+	template <int Planes, bool Checked> void plot(word x, word y)
+	{
+		if (Checked) pset<Planes>(x, y);
+		else psetUnchecked<Planes>(x, y);
+	}
+	template <int Planes> void psetSpan(word x1, word x2, word y);
+	void markDirty(int left, int top, int right, int bottom);
 	int round(float aNumber, float dirn);
-	void drawline(word x1, word y1, word x2, word y2);
-	bool okToFill(word x, word y);
-	void agiFill(word x, word y);
-
-	void xCorner(byte** data);
-	void yCorner(byte** data);
-	void relativeDraw(byte** data);
-	void fill(byte** data);
-	void absoluteLine(byte** data);
-	void plotPattern(byte x, byte y);
-	void plotBrush(byte** data);
-
+	int outcode(word x, word y);
+	void moveTo(word x, word y);
+	template <int Planes> void lineTo(word x, word y);
+	template <int Planes, bool Checked> void rasterLine(word x1, word y1, word x2, word y2, bool skipStart);
+	template <int Planes> bool okToFill(word x, word y);
+	template <int Planes> void agiFill(word x, word y);
+	template <int Planes> void referenceFillRuns(int j, const uint64_t* refRow);
+	template <int Planes> void queueFill(word x, word y);
+	bool buildFillableMask();
+	bool closeRegionRow(int y);
+	bool growRegionRow(int y, int from);
+	template <int Planes> void bitwiseFill(word x, word y);
+	template <int Planes> void verifyFill(word x, word y);
+	template <int Planes> void propagateFill();
+
+	// Handlers for the commands F0 to FF, for each combination of enabled
+	// planes.
+	typedef void (PicDrawer::*Command)(const byte** data);
+	static const Command commands[4][16];
+	bool runCommand();
+	bool stepWithReference();
+	void takeCheckpoint();
+	void restoreCheckpoint(const Checkpoint& checkpoint, const Rect& area);
+	void redrawRegion(size_t checkpoint, const Rect& area, const uint8_t* inData, unsigned length);
+	Rect scaleRect(const Rect& rect);
+	Rect fillBounds();
+	void setPictureColour(const byte** data);
+	void disablePicture(const byte** data);
+	void setPriorityColour(const byte** data);
+	void disablePriority(const byte** data);
+	void setPattern(const byte** data);
+	void endDrawing(const byte** data);
+	void unknownCommand(const byte** data);
+	void skipLine(const byte** data);
+	void skipFill(const byte** data);
+	void skipArguments(const byte** data);
+	template <int Planes> void xCorner(const byte** data);
+	template <int Planes> void yCorner(const byte** data);
+	template <int Planes> void relativeDraw(const byte** data);
+	template <int Planes> void fill(const byte** data);
+	template <int Planes> void absoluteLine(const byte** data);
+	template <int Planes> void plotPattern(byte x, byte y);
+	template <int Planes, bool Checked> void drawPattern(byte x, byte y);
+	template <int Planes> void plotBrush(const byte** data);
+
+	void markFill(word x, word y);
+	void clearFills();
 	bool didFill(word x, word y);
+	void buildFillNeighbourhood();
 	bool didReferenceFill(word x, word y);
 
 	PicDrawer* referenceDrawer = nullptr;
 
-	uint8_t* pictureData;
-	uint8_t* pictureDataPtr;
+	const uint8_t* pictureData;
+	const uint8_t* pictureDataPtr;
 	unsigned pictureDataLength;
 	bool isDrawing;
+	unsigned int commandCount;
+
+	// A checkpoint is taken every checkpointInterval commands, so
+	// checkpoints[n] holds the state after n * checkpointInterval commands.
+	unsigned int checkpointInterval = 0;
+	std::vector<Checkpoint> checkpoints;
+
+	// Area read and drawn by each fill command of a drawer without a
+	// reference drawer, used to tell whether an edit can affect it. Kept in
+	// command order up to the furthest command drawn, so fills replayed
+	// after seeking back aren't recorded twice. Only kept with checkpoints,
+	// as redrawEdited can't work without them.
+	struct FillRecord
+	{
+		unsigned int command;
+		Rect bounds;
+	};
+	std::vector<FillRecord> fillRecords;
+
+	// While redrawing a region only pixels inside the clip rectangle are
+	// drawn, fills are skipped and no checkpoints are taken.
+	word clipLeft = 0, clipTop = 0, clipRight, clipBottom;
+	bool regionOnly = false;
+
+	// Bounding rectangle of what the drawing primitives have touched
+	Rect dirty = { 0, 0, 0, 0 };
 
 	Bitmap* picture;
 	Bitmap* priority;
 
 	bool picDrawEnabled = false, priDrawEnabled = false;
-	byte picColour = 0, priColour = 0, patCode, patNum;
+	byte picColour = 0, priColour = 0, patCode = 0, patNum = 0;
 
-	uint8_t* lastFill;
+	// End of the last line drawn, in this drawer's coordinates, and its
+	// region code. cursorPlotted is set once that pixel has been drawn.
+	word cursorX, cursorY;
+	int cursorCode;
+	bool cursorPlotted;
+
+	// Pixels set by the current fill command, one bit per pixel. Each row is
+	// padded to a whole number of 64 bit words so that a row can be scanned a
+	// word at a time. Only rows fillRowMin to fillRowMax hold any set bits.
+	uint64_t* lastFill;
+	unsigned fillStride;
+	int fillRowMin, fillRowMax;
+
+	// lastFill dilated by one pixel in every direction, built once per fill
+	// command when this drawer is used as a reference.
+	uint64_t* fillNeighbourhood = nullptr;
+	int neighbourhoodRowMin, neighbourhoodRowMax;
+
+	// Reference picture coordinates for each column and row of this drawer
+	word* refX;
+	word* refY;
+
+	// Pixels added to lastFill whose neighbours haven't been examined yet
+	std::vector<uint32_t> fillFrontier, nextFrontier;
+	int fillIterations = REFERENCE_FILL_ITERATIONS;
+
+	FillEngine fillEngine = FILL_QUEUE;
+	bool verifyFills = false;
+
+	// Scratch rows for bitwiseFill, laid out like lastFill
+	uint64_t* fillableMask = nullptr;
+	uint64_t* fillRegion = nullptr;
+
+	// Pixels for rows expanded from a run length encoded bitmap
+	std::vector<uint8_t> rowScratch;
+	std::vector<Span> fillSpans;
+
+	// Scratch for fillGaps
+	std::vector<uint8_t> gapColours, gapReplacement;
+	std::vector<Run> gapRuns, gapScratchRuns;
 
 	word buf[QMAX + 1];
-	int rpos = QMAX, spos = 0;
+	int rpos = 0, spos = 0;
 
 	float picScaleX, picScaleY;
 };
 
-void PicDrawer::qstore(word q)
+// Coordinates are queued as pairs, so that when the queue is full a whole
+// pixel is dropped rather than x or y alone
+void PicDrawer::qstore(word x, word y)
 {
-   if (spos+1==rpos || (spos+1==QMAX && !rpos)) {
+   int next = (spos + 2) % QMAX;
+
+   if (next == rpos) {
       return;
    }
-   buf[spos] = q;
-   spos++;
-   if (spos==QMAX) spos = 0;  /* loop back */
+   buf[spos] = x;
+   buf[spos + 1] = y;
+   spos = next;
 }
 
-word PicDrawer::qretrieve()
+bool PicDrawer::qretrieve(word& x, word& y)
 {
-   if (rpos==QMAX) rpos=0;  /* loop back */
-   if (rpos==spos) {
-      return EMPTY;
+   if (rpos == spos) {
+      return false;
    }
-   rpos++;
-   return buf[rpos-1];
+   x = buf[rpos];
+   y = buf[rpos + 1];
+   rpos = (rpos + 2) % QMAX;
+   return true;
 }
 
 void PicDrawer::scaleCoordinates(word& x, word& y)
@@ -159,13 +797,48 @@ void PicDrawer::scaleCoordinates(word& x, word& y)
 /**************************************************************************
 ** pset
 **
-** Draws a pixel in each screen depending on whether drawing in that
-** screen is enabled or not.
+** Draws a pixel in each of the screens in Planes. The checked version
+** clips it and adds it to the dirty rectangle, the unchecked one leaves
+** that to the caller.
 **************************************************************************/
+template <int Planes>
 void PicDrawer::pset(word x, word y)
 {
-   if (picDrawEnabled) picture->Set(x, y, picColour);
-   if (priDrawEnabled) priority->Set(x, y, priColour);
+   if (x < clipLeft || x >= clipRight || y < clipTop || y >= clipBottom) return;
+   psetUnchecked<Planes>(x, y);
+   addPoint(dirty, x, y);
+}
+
+template <int Planes>
+void PicDrawer::psetUnchecked(word x, word y)
+{
+   if (Planes & PLANES_PICTURE) picture->SetUnchecked(x, y, picColour);
+   if (Planes & PLANES_PRIORITY) priority->SetUnchecked(x, y, priColour);
+}
+
+/**************************************************************************
+** psetSpan
+**
+** Draws the pixels from x1 up to but not including x2 on row y, in each
+** of the screens in Planes.
+**************************************************************************/
+template <int Planes>
+void PicDrawer::psetSpan(word x1, word x2, word y)
+{
+   if (Planes & PLANES_PICTURE) picture->SetSpan(x1, x2, y, picColour);
+   if (Planes & PLANES_PRIORITY) priority->SetSpan(x1, x2, y, priColour);
+}
+
+/**************************************************************************
+** markDirty
+**
+** Adds a rectangle that was drawn on to the dirty rectangle. right and
+** bottom are exclusive.
+**************************************************************************/
+void PicDrawer::markDirty(int left, int top, int right, int bottom)
+{
+   Rect area = { left, top, right, bottom };
+   unionRect(dirty, area);
 }
 
 /**************************************************************************
@@ -183,15 +856,72 @@ int PicDrawer::round(float aNumber, float dirn)
 }
 
 /**************************************************************************
-** drawline
+** moveTo / lineTo
+**
+** Draw AGI lines as a polyline. moveTo starts a new polyline at the given
+** picture position. Each lineTo draws a line from the end of the last one,
+** so the shared end point is only scaled, clipped and drawn once.
+**************************************************************************/
+void PicDrawer::moveTo(word x, word y)
+{
+	scaleCoordinates(x, y);
+	cursorX = x;
+	cursorY = y;
+	cursorCode = outcode(x, y);
+	cursorPlotted = false;
+}
+
+template <int Planes>
+void PicDrawer::lineTo(word x, word y)
+{
+	scaleCoordinates(x, y);
+
+	// Every pixel of a line lies within the box spanned by its end points,
+	// so lines wholly inside the picture can skip the per pixel clipping
+	// and lines wholly off one side draw nothing. The end points of lines
+	// crossing the edge aren't moved, as that would change how the line
+	// rounds, so those are clipped pixel by pixel instead.
+	int code = outcode(x, y);
+
+	if (!(cursorCode & code))
+	{
+		if (cursorCode | code)
+		{
+			rasterLine<Planes, true>(cursorX, cursorY, x, y, cursorPlotted);
+		}
+		else
+		{
+			markDirty(cursorX < x ? cursorX : x, cursorY < y ? cursorY : y,
+				(cursorX > x ? cursorX : x) + 1, (cursorY > y ? cursorY : y) + 1);
+			rasterLine<Planes, false>(cursorX, cursorY, x, y, cursorPlotted);
+		}
+	}
+
+	cursorX = x;
+	cursorY = y;
+	cursorCode = code;
+	cursorPlotted = true;
+}
+
+/**************************************************************************
+** outcode
 **
-** Draws an AGI line.
+** Cohen-Sutherland region code of a pixel relative to the clip rectangle,
+** which is normally the whole picture.
 **************************************************************************/
-void PicDrawer::drawline(word x1, word y1, word x2, word y2)
+int PicDrawer::outcode(word x, word y)
 {
-	scaleCoordinates(x1, y1);
-	scaleCoordinates(x2, y2);
+	int code = 0;
+	if (x >= clipRight) code |= 1;
+	if (y >= clipBottom) code |= 2;
+	if (x < clipLeft) code |= 4;
+	if (y < clipTop) code |= 8;
+	return code;
+}
 
+template <int Planes, bool Checked>
+void PicDrawer::rasterLine(word x1, word y1, word x2, word y2, bool skipStart)
+{
    int height, width, startX, startY;
    float x, y, addX, addY;
 
@@ -200,23 +930,39 @@ void PicDrawer::drawline(word x1, word y1, word x2, word y2)
    addX = (height==0?height:(float)width/abs(height));
    addY = (width==0?width:(float)height/abs(width));
 
+   // The first step of a line always lands exactly on its start, so
+   // skipping the start just means taking that step without drawing.
    if (abs(width) > abs(height)) {
       y = y1;
       addX = (width == 0? 0 : (width/abs(width)));
-      for (x=x1; x!=x2; x+=addX) {
-	 pset(round(x, addX), round(y, addY));
+      x = x1;
+      if (skipStart) {
 	 y+=addY;
+	 x+=addX;
       }
-      pset(x2,y2);
-   }
+      for (; x!=x2; x+=addX) {
+	 plot<Planes, Checked>(round(x, addX), round(y, addY));
+	 y+=addY;
+      }
+      plot<Planes, Checked>(x2,y2);
+   }
    else {
       x = x1;
       addY = (height == 0? 0 : (height/abs(height)));
-      for (y=y1; y!=y2; y+=addY) {
-	 pset(round(x, addX), round(y, addY));
+      if (height == 0) {
+	 if (!skipStart) plot<Planes, Checked>(x2,y2);
+	 return;
+      }
+      y = y1;
+      if (skipStart) {
+	 x+=addX;
+	 y+=addY;
+      }
+      for (; y!=y2; y+=addY) {
+	 plot<Planes, Checked>(round(x, addX), round(y, addY));
 	 x+=addX;
       }
-      pset(x2,y2);
+      plot<Planes, Checked>(x2,y2);
    }
 
 }
@@ -224,57 +970,21 @@ void PicDrawer::drawline(word x1, word y1, word x2, word y2)
 /**************************************************************************
 ** okToFill
 **************************************************************************/
+template <int Planes>
 bool PicDrawer::okToFill(word x, word y)
 {
-   if (!picDrawEnabled && !priDrawEnabled) return false;
+   if (Planes == PLANES_NONE) return false;
    if (picColour == 15) return false;
-   if (!priDrawEnabled)
-   {
-	   if (picture->Get(x, y) != 15)
-		   return false;
-
-	   if (referenceDrawer)
-	   {
-		   /*
-		   bool matches = false;
-		   for (int i = -1; i <= 1; i++)
-		   {
-			   for (int j = -1; j <= 1; j++)
-			   {
-				   matches = matches || (getReferencePicture(x + i, y + j) == picColour);
-			   }
-		   }
-		   if (!matches)
-			   return false;*/
-		   if (!didReferenceFill(x, y))
-			   return false;
-	   }
-
-	   return true;
-   }
-   if (priDrawEnabled && !picDrawEnabled)
+   if (Planes == PLANES_PRIORITY)
    {
-	   return (priority->Get(x, y) == 4);
+	   return (priority->GetUnchecked(x, y) == 4);
    }
 
-   if (picture->Get(x, y) != 15)
+   if (picture->GetUnchecked(x, y) != 15)
 	   return false;
 
    if (referenceDrawer)
    {
-	   /*
-	   bool matches = false;
-	   for (int i = -1; i <= 1; i++)
-	   {
-		   for (int j = -1; j <= 1; j++)
-		   {
-			   matches = matches || (getReferencePicture(x + i, y + j) == picColour);
-		   }
-	   }
-	   if (!matches)
-		   return false;*/
-	   //if (!referenceDrawer->didFill((word)(x / picScaleX), (word)(y / picScaleY)))
-		 //  return false;
 	   if (!didReferenceFill(x, y))
 		   return false;
    }
@@ -285,101 +995,162 @@ bool PicDrawer::okToFill(word x, word y)
 /**************************************************************************
 ** agiFill
 **************************************************************************/
+template <int Planes>
 void PicDrawer::agiFill(word x, word y)
 {
-   word x1, y1;
-   rpos = spos = 0;
-
    scaleCoordinates(x, y);
 
 	if(referenceDrawer)
 	{
 		for(int j = 0; j < picture->height; j++)
 		{
+			word scaledY = refY[j];
+
+			// Rows that the reference fill never reached can't contribute
+			if((int)scaledY < referenceDrawer->fillRowMin || (int)scaledY > referenceDrawer->fillRowMax)
+				continue;
+
+			const uint64_t* refRow = referenceDrawer->lastFill + scaledY * referenceDrawer->fillStride;
+
+			if(!picture->data)
+			{
+				referenceFillRuns<Planes>(j, refRow);
+				continue;
+			}
+
 			for(int i = 0; i < picture->width; i++)
 			{
-				if(!okToFill(i, j))
+				word scaledX = refX[i];
+
+				if(!((refRow[scaledX >> 6] >> (scaledX & 63)) & 1))
 					continue;
 				
-				word refX = (word)(i / picScaleX);
-				word refY = (word)(j / picScaleY);
-				
-				if(referenceDrawer->lastFill[refY * referenceDrawer->picture->width + refX])
+				if(okToFill<Planes>(i, j) && !didFill(i, j))
 				{
-					pset(i, j);
-					lastFill[j * picture->width + i] = true;
+					psetUnchecked<Planes>(i, j);
+					markFill(i, j);
+					fillFrontier.push_back(j * picture->width + i);
 				}
 			}
 		}
 		
-		bool* nextFill = new bool[picture->width * picture->height];
-		memset(nextFill, 0, picture->width * picture->height * sizeof(bool));
-		for(int k = 0; k < 1; k++)
+		propagateFill<Planes>();
+		
+		return;
+	}
+
+   //if (referenceDrawer)
+//	   return;
+
+   if (x >= picture->width || y >= picture->height)
+	   return;
+
+   if (verifyFills)
+   {
+	   verifyFill<Planes>(x, y);
+	   return;
+   }
+
+   if (fillEngine == FILL_BITWISE)
+   {
+	   bitwiseFill<Planes>(x, y);
+	   return;
+   }
+
+   queueFill<Planes>(x, y);
+}
+
+/**************************************************************************
+** referenceFillRuns
+**
+** The first pass of the reference fill for row j of a run length encoded
+** picture. Only runs of the colour okToFill looks for are examined, and
+** the pixels to fill are written back as spans.
+**************************************************************************/
+template <int Planes>
+void PicDrawer::referenceFillRuns(int j, const uint64_t* refRow)
+{
+	if (Planes == PLANES_NONE) return;
+	if (picColour == 15) return;
+
+	Bitmap* plane = (Planes == PLANES_PRIORITY) ? priority : picture;
+	uint8_t target = (plane == priority) ? 4 : 15;
+	const std::vector<Run>& runs = plane->rows[j];
+	unsigned int start = 0;
+
+	fillSpans.clear();
+	for (size_t n = 0; n < runs.size(); start = runs[n].end, n++)
+	{
+		if (runs[n].colour != target)
+			continue;
+
+		for (unsigned int i = start; i < runs[n].end; i++)
 		{
-			for(int j = 0; j < picture->height; j++)
+			word scaledX = refX[i];
+
+			if (!((refRow[scaledX >> 6] >> (scaledX & 63)) & 1))
+				continue;
+			if (!okToFill<Planes>(i, j) || didFill(i, j))
+				continue;
+
+			if (!fillSpans.empty() && fillSpans.back().end == i)
 			{
-				for(int i = 0; i < picture->width; i++)
-				{
-					if(!okToFill(i, j))
-						continue;
-
-					if((i > 0 && lastFill[j * picture->width + i - 1])
-					|| (i < picture->width - 1 && lastFill[j * picture->width + i + 1])
-					|| (j < picture->height - 1 && lastFill[(j + 1) * picture->width + i])
-					|| (j > 0 && lastFill[(j - 1) * picture->width + i]))
-					{
-						pset(i, j);
-						nextFill[j * picture->width + i] = true;
-					}
-				}
+				fillSpans.back().end++;
 			}
-			
-			for(int i = 0; i < picture->width * picture->height; i++)
+			else
 			{
-				lastFill[i] = lastFill[i] || nextFill[i];
+				Span span = { i, i + 1 };
+				fillSpans.push_back(span);
 			}
 		}
-		
-		delete[] nextFill;
-		
-		return;
 	}
 
-   //if (referenceDrawer)
-//	   return;
+	for (size_t n = 0; n < fillSpans.size(); n++)
+	{
+		psetSpan<Planes>(fillSpans[n].start, fillSpans[n].end, j);
+		for (unsigned int i = fillSpans[n].start; i < fillSpans[n].end; i++)
+		{
+			markFill(i, j);
+			fillFrontier.push_back(j * picture->width + i);
+		}
+	}
+}
 
-   qstore(x);
-   qstore(y);
+/**************************************************************************
+** queueFill
+**
+** The classic AGI flood fill, visiting pixels through a queue.
+**************************************************************************/
+template <int Planes>
+void PicDrawer::queueFill(word x, word y)
+{
+   word x1, y1;
+   rpos = spos = 0;
 
-   for (;;) {
+   qstore(x, y);
 
-      x1 = qretrieve();
-      y1 = qretrieve();
+   for (;;) {
 
-      if ((x1 == EMPTY) || (y1 == EMPTY))
+      if (!qretrieve(x1, y1))
 	 break;
       else {
 
-	 if (okToFill(x1,y1)) {
+	 if (okToFill<Planes>(x1,y1)) {
 
-	    pset(x1, y1);
-		lastFill[y1 * picture->width + x1] = 1;
+	    psetUnchecked<Planes>(x1, y1);
+		markFill(x1, y1);
 
-	    if (okToFill(x1, y1-1) && (y1!=0)) {
-	       qstore(x1);
-	       qstore(y1-1);
+	    if ((y1!=0) && okToFill<Planes>(x1, y1-1)) {
+	       qstore(x1, y1-1);
 	    }
-	    if (okToFill(x1-1, y1) && (x1!=0)) {
-	       qstore(x1-1);
-	       qstore(y1);
+	    if ((x1!=0) && okToFill<Planes>(x1-1, y1)) {
+	       qstore(x1-1, y1);
 	    }
-	    if (okToFill(x1+1, y1) && (x1!=picture->width - 1)) {
-	       qstore(x1+1);
-	       qstore(y1);
+	    if ((x1!=picture->width - 1) && okToFill<Planes>(x1+1, y1)) {
+	       qstore(x1+1, y1);
 	    }
-	    if (okToFill(x1, y1+1) && (y1!=picture->height - 1)) {
-	       qstore(x1);
-	       qstore(y1+1);
+	    if ((y1!=picture->height - 1) && okToFill<Planes>(x1, y1+1)) {
+	       qstore(x1, y1+1);
 	    }
 
 	 }
@@ -390,12 +1161,363 @@ void PicDrawer::agiFill(word x, word y)
 
 }
 
+/**************************************************************************
+** lowestBit / highestBit
+**
+** Index of the lowest or highest set bit. bits must not be zero. 32 bit
+** MSVC builds only have the 32 bit scans, so look at each half there.
+**************************************************************************/
+static inline int lowestBit(uint64_t bits)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (unsigned long)bits))
+	{
+		return (int)index;
+	}
+	_BitScanForward(&index, (unsigned long)(bits >> 32));
+	return (int)index + 32;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+static inline int highestBit(uint64_t bits)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long index;
+	_BitScanReverse64(&index, bits);
+	return (int)index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanReverse(&index, (unsigned long)(bits >> 32)))
+	{
+		return (int)index + 32;
+	}
+	_BitScanReverse(&index, (unsigned long)bits);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(bits);
+#endif
+}
+
+/**************************************************************************
+** spreadUp / spreadDown
+**
+** Extend the set bits of seeds along runs of set bits in mask, towards
+** the high or low end of the word. Seeds must be a subset of mask.
+**************************************************************************/
+static inline uint64_t spreadUp(uint64_t seeds, uint64_t mask)
+{
+	seeds |= mask & (seeds << 1);  mask &= mask << 1;
+	seeds |= mask & (seeds << 2);  mask &= mask << 2;
+	seeds |= mask & (seeds << 4);  mask &= mask << 4;
+	seeds |= mask & (seeds << 8);  mask &= mask << 8;
+	seeds |= mask & (seeds << 16); mask &= mask << 16;
+	seeds |= mask & (seeds << 32);
+	return seeds;
+}
+
+static inline uint64_t spreadDown(uint64_t seeds, uint64_t mask)
+{
+	seeds |= mask & (seeds >> 1);  mask &= mask >> 1;
+	seeds |= mask & (seeds >> 2);  mask &= mask >> 2;
+	seeds |= mask & (seeds >> 4);  mask &= mask >> 4;
+	seeds |= mask & (seeds >> 8);  mask &= mask >> 8;
+	seeds |= mask & (seeds >> 16); mask &= mask >> 16;
+	seeds |= mask & (seeds >> 32);
+	return seeds;
+}
+
+/**************************************************************************
+** buildFillableMask
+**
+** Packs the okToFill predicate for every pixel into fillableMask. Returns
+** false if nothing can be filled with the current drawing state.
+**************************************************************************/
+bool PicDrawer::buildFillableMask()
+{
+	if (!picDrawEnabled && !priDrawEnabled) return false;
+	if (picColour == 15) return false;
+
+	Bitmap* plane = (priDrawEnabled && !picDrawEnabled) ? priority : picture;
+	uint8_t target = (plane == priority) ? 4 : 15;
+	unsigned int width = plane->width;
+
+	memset(fillableMask, 0, fillStride * picture->height * sizeof(uint64_t));
+
+	for (unsigned int y = 0; y < plane->height; y++)
+	{
+		const uint8_t* row = plane->GetRow(y, rowScratch.data());
+		uint64_t* bits = fillableMask + y * fillStride;
+		unsigned int x = 0;
+
+#if defined(USE_SSE2)
+		const __m128i match = _mm_set1_epi8(target);
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+			uint64_t found = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, match));
+			bits[x >> 6] |= found << (x & 63);
+		}
+#endif
+		for (; x < width; x++)
+		{
+			if (row[x] == target)
+			{
+				bits[x >> 6] |= (uint64_t)1 << (x & 63);
+			}
+		}
+	}
+
+	return true;
+}
+
+/**************************************************************************
+** closeRegionRow
+**
+** Grows the region along row y to cover every fillable run it touches.
+** Returns whether the row changed.
+**************************************************************************/
+bool PicDrawer::closeRegionRow(int y)
+{
+	uint64_t* row = fillRegion + y * fillStride;
+	const uint64_t* mask = fillableMask + y * fillStride;
+	bool changed = false, changedPass;
+
+	do
+	{
+		changedPass = false;
+		for (unsigned n = 0; n < fillStride; n++)
+		{
+			uint64_t bits = row[n];
+			if (n > 0 && (row[n - 1] >> 63)) bits |= mask[n] & 1;
+			if (n < fillStride - 1 && (row[n + 1] & 1)) bits |= mask[n] & ((uint64_t)1 << 63);
+			if (!bits)
+				continue;
+
+			bits = spreadDown(spreadUp(bits, mask[n]), mask[n]);
+			if (bits != row[n])
+			{
+				row[n] = bits;
+				changedPass = changed = true;
+			}
+		}
+	} while (changedPass);
+
+	return changed;
+}
+
+/**************************************************************************
+** growRegionRow
+**
+** Adds the fillable pixels of row y below or above the region in row
+** from, then closes the row. Returns whether the row changed.
+**************************************************************************/
+bool PicDrawer::growRegionRow(int y, int from)
+{
+	uint64_t* row = fillRegion + y * fillStride;
+	const uint64_t* source = fillRegion + from * fillStride;
+	const uint64_t* mask = fillableMask + y * fillStride;
+	bool grown = false;
+
+	for (unsigned n = 0; n < fillStride; n++)
+	{
+		uint64_t added = source[n] & mask[n] & ~row[n];
+		if (added)
+		{
+			row[n] |= added;
+			grown = true;
+		}
+	}
+
+	if (grown)
+	{
+		closeRegionRow(y);
+	}
+	return grown;
+}
+
+/**************************************************************************
+** bitwiseFill
+**
+** Fills the same area as queueFill, but works on whole rows of packed
+** fillable bits, growing the region up and down with word wide shifts
+** until nothing changes.
+**************************************************************************/
+template <int Planes>
+void PicDrawer::bitwiseFill(word x, word y)
+{
+	if (!okToFill<Planes>(x, y) || !buildFillableMask())
+		return;
+
+	int height = picture->height;
+	int regionMin = y, regionMax = y;
+
+	memset(fillRegion + y * fillStride, 0, fillStride * sizeof(uint64_t));
+	fillRegion[y * fillStride + (x >> 6)] = (uint64_t)1 << (x & 63);
+	closeRegionRow(y);
+
+	bool changed;
+	do
+	{
+		changed = false;
+
+		for (int j = regionMin; j < height - 1; j++)
+		{
+			if (j + 1 > regionMax)
+			{
+				memset(fillRegion + (j + 1) * fillStride, 0, fillStride * sizeof(uint64_t));
+				if (!growRegionRow(j + 1, j))
+					break;
+				regionMax = j + 1;
+				changed = true;
+			}
+			else if (growRegionRow(j + 1, j))
+			{
+				changed = true;
+			}
+		}
+
+		for (int j = regionMax; j > 0; j--)
+		{
+			if (j - 1 < regionMin)
+			{
+				memset(fillRegion + (j - 1) * fillStride, 0, fillStride * sizeof(uint64_t));
+				if (!growRegionRow(j - 1, j))
+					break;
+				regionMin = j - 1;
+				changed = true;
+			}
+			else if (growRegionRow(j - 1, j))
+			{
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	for (int j = regionMin; j <= regionMax; j++)
+	{
+		const uint64_t* row = fillRegion + j * fillStride;
+
+		for (unsigned n = 0; n < fillStride; n++)
+		{
+			uint64_t bits = row[n];
+			if (!bits)
+				continue;
+
+			lastFill[j * fillStride + n] |= bits;
+			while (bits)
+			{
+				psetUnchecked<Planes>(n * 64 + lowestBit(bits), j);
+				bits &= bits - 1;
+			}
+		}
+	}
+
+	if (regionMin < fillRowMin) fillRowMin = regionMin;
+	if (regionMax > fillRowMax) fillRowMax = regionMax;
+}
+
+/**************************************************************************
+** verifyFill
+**
+** Runs bitwiseFill and queueFill from the same state and reports any
+** difference between them. The result of queueFill is kept.
+**************************************************************************/
+template <int Planes>
+void PicDrawer::verifyFill(word x, word y)
+{
+	size_t fillSize = fillStride * picture->height;
+	std::vector<uint8_t> savedPicture, savedPriority;
+	std::vector<uint64_t> savedFill(lastFill, lastFill + fillSize);
+	int savedRowMin = fillRowMin, savedRowMax = fillRowMax;
+
+	picture->CopyTo(savedPicture);
+	priority->CopyTo(savedPriority);
+
+	bitwiseFill<Planes>(x, y);
+
+	std::vector<uint8_t> bitwisePicture, bitwisePriority;
+	std::vector<uint64_t> bitwiseFillBits(lastFill, lastFill + fillSize);
+
+	picture->CopyTo(bitwisePicture);
+	priority->CopyTo(bitwisePriority);
+
+	picture->CopyFrom(savedPicture);
+	priority->CopyFrom(savedPriority);
+	memcpy(lastFill, savedFill.data(), fillSize * sizeof(uint64_t));
+	fillRowMin = savedRowMin;
+	fillRowMax = savedRowMax;
+
+	queueFill<Planes>(x, y);
+
+	std::vector<uint8_t> queuePicture, queuePriority;
+	picture->CopyTo(queuePicture);
+	priority->CopyTo(queuePriority);
+
+	fillStats.verified++;
+	if (queuePicture != bitwisePicture || queuePriority != bitwisePriority
+		|| memcmp(lastFill, bitwiseFillBits.data(), fillSize * sizeof(uint64_t)))
+	{
+		fillStats.mismatched++;
+		printf("Fill engines disagree at %d, %d (width: %d, height: %d)\n", x, y, picture->width, picture->height);
+	}
+}
+
+/**************************************************************************
+** propagateFill
+**
+** Grows the upscaled fill into fillable neighbours of the frontier, one
+** pixel per iteration. Only pixels added since the last step are looked
+** at, so the cost follows the size of the fill rather than the picture.
+** The frontier carries over to the next seed of the same fill command.
+**************************************************************************/
+template <int Planes>
+void PicDrawer::propagateFill()
+{
+	int width = picture->width, height = picture->height;
+
+	for (int k = 0; k < fillIterations && !fillFrontier.empty(); k++)
+	{
+		nextFrontier.clear();
+
+		for (size_t n = 0; n < fillFrontier.size(); n++)
+		{
+			int i = fillFrontier[n] % width;
+			int j = fillFrontier[n] / width;
+			int neighbours[4][2] = { { i - 1, j }, { i + 1, j }, { i, j - 1 }, { i, j + 1 } };
+
+			for (int m = 0; m < 4; m++)
+			{
+				int nx = neighbours[m][0], ny = neighbours[m][1];
+
+				if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+					continue;
+				if (didFill(nx, ny) || !okToFill<Planes>(nx, ny))
+					continue;
+
+				psetUnchecked<Planes>(nx, ny);
+				markFill(nx, ny);
+				nextFrontier.push_back(ny * width + nx);
+			}
+		}
+
+		fillFrontier.swap(nextFrontier);
+	}
+}
+
 /**************************************************************************
 ** xCorner
 **
 ** Draws an xCorner  (drawing action 0xF5)
 **************************************************************************/
-void PicDrawer::xCorner(byte **data)
+template <int Planes>
+void PicDrawer::xCorner(const byte **data)
 {
    byte x1, x2, y1, y2;
 
@@ -404,18 +1526,19 @@ void PicDrawer::xCorner(byte **data)
 
 //   scaleCoordinates(x1, y1);
 
-   pset((word)(picScaleX * x1),(word)(picScaleY * y1));
+   pset<Planes>((word)(picScaleX * x1),(word)(picScaleY * y1));
+   moveTo(x1, y1);
 
    for (;;) {
       x2 = *((*data)++);
 	  //x2 = (word)(x2 * picScaleX);
       if (x2 >= 0xF0) break;
-      drawline(x1, y1, x2, y1);
+      lineTo<Planes>(x2, y1);
       x1 = x2;
       y2 = *((*data)++);
 	  //y2 = (word)(y2 * picScaleX);
       if (y2 >= 0xF0) break;
-      drawline(x1, y1, x1, y2);
+      lineTo<Planes>(x1, y2);
       y1 = y2;
    }
 
@@ -427,7 +1550,8 @@ void PicDrawer::xCorner(byte **data)
 **
 ** Draws an yCorner  (drawing action 0xF4)
 **************************************************************************/
-void PicDrawer::yCorner(byte **data)
+template <int Planes>
+void PicDrawer::yCorner(const byte **data)
 {
    byte x1, x2, y1, y2;
 
@@ -435,18 +1559,19 @@ void PicDrawer::yCorner(byte **data)
    y1 = *((*data)++);
 
    //scaleCoordinates(x1, y1);
-   pset((word)(picScaleX * x1), (word)(picScaleY * y1));
+   pset<Planes>((word)(picScaleX * x1), (word)(picScaleY * y1));
+   moveTo(x1, y1);
 
    for (;;) {
       y2 = *((*data)++);
 	  //y2 = (word)(y2 * picScaleX);
 	  if (y2 >= 0xF0) break;
-      drawline(x1, y1, x1, y2);
+      lineTo<Planes>(x1, y2);
       y1 = y2;
       x2 = *((*data)++);
 	  //x2 = (word)(x2 * picScaleX);
       if (x2 >= 0xF0) break;
-      drawline(x1, y1, x2, y1);
+      lineTo<Planes>(x2, y1);
       x1 = x2;
    }
 
@@ -458,7 +1583,8 @@ void PicDrawer::yCorner(byte **data)
 **
 ** Draws short lines relative to last position.  (drawing action 0xF7)
 **************************************************************************/
-void PicDrawer::relativeDraw(byte **data)
+template <int Planes>
+void PicDrawer::relativeDraw(const byte **data)
 {
    word x1, y1, disp;
    char dx, dy;
@@ -466,7 +1592,8 @@ void PicDrawer::relativeDraw(byte **data)
    x1 = *((*data)++);
    y1 = *((*data)++);
    
-   pset((word)(picScaleX * x1), (word)(picScaleY * y1));
+   pset<Planes>((word)(picScaleX * x1), (word)(picScaleY * y1));
+   moveTo(x1, y1);
 
    for (;;) {
       disp = *((*data)++);
@@ -475,7 +1602,7 @@ void PicDrawer::relativeDraw(byte **data)
       dy = (disp & 0x0F);
       if (dx & 0x08) dx = (-1)*(dx & 0x07);
       if (dy & 0x08) dy = (-1)*(dy & 0x07);
-      drawline(x1, y1, x1 + dx, y1 + dy);
+      lineTo<Planes>(x1 + dx, y1 + dy);
       x1 += dx;
       y1 += dy;
    }
@@ -488,19 +1615,56 @@ void PicDrawer::relativeDraw(byte **data)
 **
 ** Agi flood fill.  (drawing action 0xF8)
 **************************************************************************/
-void PicDrawer::fill(byte **data)
+template <int Planes>
+void PicDrawer::fill(const byte **data)
 {
-	memset(lastFill, 0, picture->width * picture->height);
+	if (regionOnly)
+	{
+		skipFill(data);
+		return;
+	}
+
+	// Fills that could never finish are skipped, as in the original
+	// interpreter: white can't be filled with white, and a fill of just
+	// the priority screen in colour 4 would keep finding the pixels it had
+	// drawn. The flags are checked rather than Planes so that an upscaled
+	// drawer without a priority screen skips the same fills as its
+	// reference.
+	if (picColour == 15 || (!picDrawEnabled && priDrawEnabled && priColour == 4))
+	{
+		skipFill(data);
+		return;
+	}
+
+	clearFills();
+	fillFrontier.clear();
+
+	if (referenceDrawer)
+	{
+		referenceDrawer->buildFillNeighbourhood();
+	}
 
    byte x1, y1;
+   Rect seeds = { 0, 0, 0, 0 };
 
    for (;;) {
       if ((x1 = *((*data)++)) >= 0xF0) break;
       if ((y1 = *((*data)++)) >= 0xF0) break;
-      agiFill(x1, y1);
+      addPoint(seeds, x1, y1);
+      agiFill<Planes>(x1, y1);
    }
 
    (*data)--;
+
+   Rect filled = fillBounds();
+   unionRect(dirty, filled);
+
+   if (!referenceDrawer && checkpointInterval && (fillRecords.empty() || fillRecords.back().command < commandCount - 1))
+   {
+	   unionRect(filled, seeds);
+	   FillRecord record = { commandCount - 1, filled };
+	   fillRecords.push_back(record);
+   }
 }
 
 /**************************************************************************
@@ -508,19 +1672,21 @@ void PicDrawer::fill(byte **data)
 **
 ** Draws long lines to actual locations (cf. relative) (drawing action 0xF6)
 **************************************************************************/
-void PicDrawer::absoluteLine(byte **data)
+template <int Planes>
+void PicDrawer::absoluteLine(const byte **data)
 {
    word x1, y1, x2, y2;
 
    x1 = *((*data)++);
    y1 = *((*data)++);
 
-   pset((word)(picScaleX * x1), (word)(picScaleY * y1));
+   pset<Planes>((word)(picScaleX * x1), (word)(picScaleY * y1));
+   moveTo(x1, y1);
 
    for (;;) {
       if ((x2 = *((*data)++)) >= 0xF0) break;
       if ((y2 = *((*data)++)) >= 0xF0) break;
-      drawline(x1, y1, x2, y2);
+      lineTo<Planes>(x2, y2);
       x1 = x2;
       y1 = y2;
    }
@@ -529,12 +1695,49 @@ void PicDrawer::absoluteLine(byte **data)
 }
 
 
+static int8_t circles[][15] = { /* agi circle bitmaps */
+  {0x80},
+  {0xfc},
+  {0x5f, 0xf4},
+  {0x66, 0xff, 0xf6, 0x60},
+  {0x23, 0xbf, 0xff, 0xff, 0xee, 0x20},
+  {0x31, 0xe7, 0x9e, 0xff, 0xff, 0xde, 0x79, 0xe3, 0x00},
+  {0x38, 0xf9, 0xf3, 0xef, 0xff, 0xff, 0xff, 0xfe, 0xf9, 0xf3, 0xe3, 0x80},
+  {0x18, 0x3c, 0x7e, 0x7e, 0x7e, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7e, 0x7e,
+   0x7e, 0x3c, 0x18}
+};
+
+static byte splatterMap[32] = { /* splatter brush bitmaps */
+  0x20, 0x94, 0x02, 0x24, 0x90, 0x82, 0xa4, 0xa2,
+  0x82, 0x09, 0x0a, 0x22, 0x12, 0x10, 0x42, 0x14,
+  0x91, 0x4a, 0x91, 0x11, 0x08, 0x12, 0x25, 0x10,
+  0x22, 0xa8, 0x14, 0x24, 0x00, 0x50, 0x24, 0x04
+};
+
+static byte splatterStart[128] = { /* starting bit position */
+  0x00, 0x18, 0x30, 0xc4, 0xdc, 0x65, 0xeb, 0x48,
+  0x60, 0xbd, 0x89, 0x05, 0x0a, 0xf4, 0x7d, 0x7d,
+  0x85, 0xb0, 0x8e, 0x95, 0x1f, 0x22, 0x0d, 0xdf,
+  0x2a, 0x78, 0xd5, 0x73, 0x1c, 0xb4, 0x40, 0xa1,
+  0xb9, 0x3c, 0xca, 0x58, 0x92, 0x34, 0xcc, 0xce,
+  0xd7, 0x42, 0x90, 0x0f, 0x8b, 0x7f, 0x32, 0xed,
+  0x5c, 0x9d, 0xc8, 0x99, 0xad, 0x4e, 0x56, 0xa6,
+  0xf7, 0x68, 0xb7, 0x25, 0x82, 0x37, 0x3a, 0x51,
+  0x69, 0x26, 0x38, 0x52, 0x9e, 0x9a, 0x4f, 0xa7,
+  0x43, 0x10, 0x80, 0xee, 0x3d, 0x59, 0x35, 0xcf,
+  0x79, 0x74, 0xb5, 0xa2, 0xb1, 0x96, 0x23, 0xe0,
+  0xbe, 0x05, 0xf5, 0x6e, 0x19, 0xc5, 0x66, 0x49,
+  0xf0, 0xd1, 0x54, 0xa9, 0x70, 0x4b, 0xa4, 0xe2,
+  0xe6, 0xe5, 0xab, 0xe4, 0xd2, 0xaa, 0x4c, 0xe3,
+  0x06, 0x6f, 0xc6, 0x4a, 0xa4, 0x75, 0x97, 0xe1
+};
+
 #define plotPatternPoint() \
    if (patCode & 0x20) { \
-      if ((splatterMap[bitPos>>3] >> (7-(bitPos&7))) & 1) pset((word)(x1 * picScaleX), (word)(y1 * picScaleY)); \
+      if ((splatterMap[bitPos>>3] >> (7-(bitPos&7))) & 1) plot<Planes, Checked>((word)(x1 * picScaleX), (word)(y1 * picScaleY)); \
       bitPos++; \
       if (bitPos == 0xff) bitPos=0; \
-   } else pset((word)(x1 * picScaleX), (word)(y1 * picScaleY))
+   } else plot<Planes, Checked>((word)(x1 * picScaleX), (word)(y1 * picScaleY))
 
 /**************************************************************************
 ** plotPattern
@@ -542,55 +1745,39 @@ void PicDrawer::absoluteLine(byte **data)
 ** Draws pixels, circles, squares, or splatter brush patterns depending
 ** on the pattern code.
 **************************************************************************/
+template <int Planes>
 void PicDrawer::plotPattern(byte x, byte y)
 { 
-  static int8_t circles[][15] = { /* agi circle bitmaps */
-    {0x80},
-    {0xfc},
-    {0x5f, 0xf4},
-    {0x66, 0xff, 0xf6, 0x60},
-    {0x23, 0xbf, 0xff, 0xff, 0xee, 0x20},
-    {0x31, 0xe7, 0x9e, 0xff, 0xff, 0xde, 0x79, 0xe3, 0x00},
-    {0x38, 0xf9, 0xf3, 0xef, 0xff, 0xff, 0xff, 0xfe, 0xf9, 0xf3, 0xe3, 0x80},
-    {0x18, 0x3c, 0x7e, 0x7e, 0x7e, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7e, 0x7e,
-     0x7e, 0x3c, 0x18}
-  };
-
-  static byte splatterMap[32] = { /* splatter brush bitmaps */
-    0x20, 0x94, 0x02, 0x24, 0x90, 0x82, 0xa4, 0xa2,
-    0x82, 0x09, 0x0a, 0x22, 0x12, 0x10, 0x42, 0x14,
-    0x91, 0x4a, 0x91, 0x11, 0x08, 0x12, 0x25, 0x10,
-    0x22, 0xa8, 0x14, 0x24, 0x00, 0x50, 0x24, 0x04
-  };
-
-  static byte splatterStart[128] = { /* starting bit position */
-    0x00, 0x18, 0x30, 0xc4, 0xdc, 0x65, 0xeb, 0x48,
-    0x60, 0xbd, 0x89, 0x05, 0x0a, 0xf4, 0x7d, 0x7d,
-    0x85, 0xb0, 0x8e, 0x95, 0x1f, 0x22, 0x0d, 0xdf,
-    0x2a, 0x78, 0xd5, 0x73, 0x1c, 0xb4, 0x40, 0xa1,
-    0xb9, 0x3c, 0xca, 0x58, 0x92, 0x34, 0xcc, 0xce,
-    0xd7, 0x42, 0x90, 0x0f, 0x8b, 0x7f, 0x32, 0xed,
-    0x5c, 0x9d, 0xc8, 0x99, 0xad, 0x4e, 0x56, 0xa6,
-    0xf7, 0x68, 0xb7, 0x25, 0x82, 0x37, 0x3a, 0x51,
-    0x69, 0x26, 0x38, 0x52, 0x9e, 0x9a, 0x4f, 0xa7,
-    0x43, 0x10, 0x80, 0xee, 0x3d, 0x59, 0x35, 0xcf,
-    0x79, 0x74, 0xb5, 0xa2, 0xb1, 0x96, 0x23, 0xe0,
-    0xbe, 0x05, 0xf5, 0x6e, 0x19, 0xc5, 0x66, 0x49,
-    0xf0, 0xd1, 0x54, 0xa9, 0x70, 0x4b, 0xa4, 0xe2,
-    0xe6, 0xe5, 0xab, 0xe4, 0xd2, 0xaa, 0x4c, 0xe3,
-    0x06, 0x6f, 0xc6, 0x4a, 0xa4, 0x75, 0x97, 0xe1
-  };
-
-  int circlePos = 0;
-  byte x1, y1, penSize, bitPos = splatterStart[patNum];
-
-  penSize = (patCode&7);
+  byte penSize = (patCode&7);
 
   if (x<((penSize/2)+1)) x=((penSize/2)+1);
   else if (x>160-((penSize/2)+1)) x=160-((penSize/2)+1);
   if (y<penSize) y = penSize;
   else if (y>=168-penSize) y=167-penSize;
 
+  /* clip the whole brush once rather than every pixel */
+  word left = (word)((x - (int)ceil((float)penSize/2)) * picScaleX);
+  word top = (word)((y - penSize) * picScaleY);
+  word right = (word)((x + (int)floor((float)penSize/2)) * picScaleX);
+  word bottom = (word)((y + penSize) * picScaleY);
+
+  if (left >= clipLeft && top >= clipTop && right < clipRight && bottom < clipBottom)
+  {
+    markDirty(left, top, right + 1, bottom + 1);
+    drawPattern<Planes, false>(x, y);
+  }
+  else
+    drawPattern<Planes, true>(x, y);
+}
+
+template <int Planes, bool Checked>
+void PicDrawer::drawPattern(byte x, byte y)
+{
+  int circlePos = 0;
+  byte x1, y1, penSize, bitPos = splatterStart[patNum];
+
+  penSize = (patCode&7);
+
   for (y1=y-penSize; y1<=y+penSize; y1++) {
     for (x1=x-(ceil((float)penSize/2)); x1<=x+(floor((float)penSize/2)); x1++) {
       if (patCode & 0x10) { /* Square */
@@ -613,37 +1800,416 @@ void PicDrawer::plotPattern(byte x, byte y)
 **
 ** Plots points and various brush patterns.
 **************************************************************************/
-void PicDrawer::plotBrush(byte **data)
+template <int Planes>
+void PicDrawer::plotBrush(const byte **data)
 {
    byte x1, y1, store;
 
    for (;;) {
      if (patCode & 0x20) {
-	if ((patNum = *((*data)++)) >= 0xF0) break;
-	patNum = (patNum >> 1 & 0x7f);
+	if ((store = *((*data)++)) >= 0xF0) break;
+	patNum = (store >> 1 & 0x7f);
      }
      if ((x1 = *((*data)++)) >= 0xF0) break;
      if ((y1 = *((*data)++)) >= 0xF0) break;
-     plotPattern(x1, y1);
+     plotPattern<Planes>(x1, y1);
    }
 
    (*data)--;
 }
 
 /**************************************************************************
-** getLength
+** MappedFile
 **
-** Return the length of the given file.
+** A file mapped read only into memory, so that pictures are validated and
+** drawn straight from the page cache without being copied. An empty file
+** has no mapping and a null data pointer.
 **************************************************************************/
-long getLength(FILE *file)
+class MappedFile
 {
-	long tmp;
+public:
+	~MappedFile() { unmap(); }
+
+	bool map(const char* path);
+	void unmap();
+
+	const uint8_t* data = nullptr;
+	unsigned length = 0;
+};
+
+bool MappedFile::map(const char* path)
+{
+	unmap();
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	length = (unsigned)size.QuadPart;
+	if (length)
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+#else
+	int file = open(path, O_RDONLY);
+	struct stat info;
+
+	if (file < 0)
+	{
+		return false;
+	}
+	if (fstat(file, &info))
+	{
+		close(file);
+		return false;
+	}
+
+	length = (unsigned)info.st_size;
+	if (length)
+	{
+		void* view = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+		if (view != MAP_FAILED)
+		{
+			data = (const uint8_t*)view;
+		}
+	}
+	close(file);
+#endif
+
+	if (length && !data)
+	{
+		length = 0;
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::unmap()
+{
+	if (data)
+	{
+#if defined(_WIN32)
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, length);
+#endif
+	}
+	data = nullptr;
+	length = 0;
+}
+
+/**************************************************************************
+** AGIGame
+**
+** Finds the pictures of an AGI version 2 game in its VOL files, using the
+** index in PICDIR. Each PICDIR entry is three bytes: the volume number in
+** the top four bits and the offset into VOL.n in the other twenty, with
+** an offset of FFFFF for pictures that don't exist. In the volume each
+** picture starts with 12 34, the volume number and its length, low byte
+** first. The index is read once and volumes are mapped when first used.
+** Version 3 games keep their directories in one compressed file and
+** aren't supported.
+**************************************************************************/
+class AGIGame
+{
+public:
+	bool open(const char* inDirectory);
+	unsigned int pictureCount() { return (unsigned int)index.size(); }
+	bool hasPicture(unsigned int number) { return number < index.size() && index[number].offset != NO_PICTURE; }
+	const char* findPicture(unsigned int number, const uint8_t*& data, unsigned& length);
+
+private:
+	static const uint32_t NO_PICTURE = 0xFFFFF;
+
+	struct Entry
+	{
+		uint8_t volume;
+		uint32_t offset;
+	};
+
+	const char* directory;
+	std::vector<Entry> index;
+	MappedFile volumes[16];
+	bool volumeMapped[16] = { false };
+};
+
+bool AGIGame::open(const char* inDirectory)
+{
+	char path[1024];
+	MappedFile picdir;
+
+	snprintf(path, sizeof(path), "%s/PICDIR", inDirectory);
+	if (!picdir.map(path))
+	{
+		printf("Error opening file : %s (only version 2 games are supported)\n", path);
+		return false;
+	}
+
+	directory = inDirectory;
+	index.clear();
+	for (unsigned pos = 0; pos + 3 <= picdir.length; pos += 3)
+	{
+		const uint8_t* bytes = picdir.data + pos;
+		Entry entry = { (uint8_t)(bytes[0] >> 4), ((uint32_t)(bytes[0] & 0x0F) << 16) | (bytes[1] << 8) | bytes[2] };
+		index.push_back(entry);
+	}
+	return true;
+}
+
+// Returns NULL and the picture's data if it can be found, otherwise what
+// went wrong
+const char* AGIGame::findPicture(unsigned int number, const uint8_t*& data, unsigned& length)
+{
+	if (!hasPicture(number))
+	{
+		return "not in PICDIR";
+	}
+
+	const Entry& entry = index[number];
+	MappedFile& volume = volumes[entry.volume];
+
+	if (!volumeMapped[entry.volume])
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/VOL.%d", directory, entry.volume);
+		volume.map(path);
+		volumeMapped[entry.volume] = true;
+	}
+
+	if (!volume.data)
+	{
+		return "its VOL file is missing or empty";
+	}
+	if (entry.offset + 5 > volume.length)
+	{
+		return "its offset is past the end of the VOL file";
+	}
+
+	const uint8_t* header = volume.data + entry.offset;
+	if (header[0] != 0x12 || header[1] != 0x34)
+	{
+		return "no resource header at its offset";
+	}
+
+	length = header[3] | (header[4] << 8);
+	if (entry.offset + 5 + length > volume.length)
+	{
+		return "it runs past the end of the VOL file";
+	}
+
+	data = header + 5;
+	return NULL;
+}
+
+/**************************************************************************
+** validatePicture
+**
+** Checks in one pass that a picture is well formed, consuming bytes just
+** as the drawing commands do. Returns NULL if it is, otherwise describes
+** the problem and sets offset to where it was found. The drawers don't
+** check for the end of the data within a command, so only pictures that
+** pass should be drawn. Fills that could never finish are accepted, as
+** the drawers skip them.
+**************************************************************************/
+const char* validatePicture(const uint8_t* data, unsigned length, unsigned& offset)
+{
+	unsigned pos = 0;
+
+	if (length == 0)
+	{
+		offset = 0;
+		return "no picture data";
+	}
+
+	while (pos < length)
+	{
+		offset = pos;
+		uint8_t action = data[pos++];
+
+		switch (action) {
+		case 0xFF:
+			return NULL;
+		case 0xF0:
+		case 0xF2:
+		case 0xF9:
+			if (pos >= length) return "missing argument";
+			pos++;
+			break;
+		case 0xF1:
+		case 0xF3:
+			break;
+		case 0xF4:
+		case 0xF5:
+		case 0xF6:
+		case 0xF7:
+			if (length - pos < 2) return "missing start position";
+			pos += 2;
+			// fall through
+		case 0xF8:
+		case 0xFA:
+			while (pos < length && data[pos] < 0xF0)
+			{
+				pos++;
+			}
+			if (pos >= length) return "unterminated command";
+			break;
+		default:
+			return "unknown picture code";
+		}
+	}
+
+	return NULL;
+}
+
+/**************************************************************************
+** nextCommand
+**
+** The offset of the command after the one at pos, in a validated picture.
+**************************************************************************/
+unsigned nextCommand(const uint8_t* data, unsigned length, unsigned pos)
+{
+	uint8_t action = data[pos++];
+
+	switch (action) {
+	case 0xF0:
+	case 0xF2:
+	case 0xF9:
+		return pos + 1;
+	case 0xF4:
+	case 0xF5:
+	case 0xF6:
+	case 0xF7:
+		pos += 2;
+		// fall through
+	case 0xF8:
+	case 0xFA:
+		while (pos < length && data[pos] < 0xF0)
+		{
+			pos++;
+		}
+		return pos;
+	case 0xFF:
+		return length;
+	default:
+		return pos;
+	}
+}
+
+/**************************************************************************
+** commandOffset
+**
+** The offset of command number index in a validated picture, or length if
+** there are fewer commands. Also gives the pattern code in force there.
+**************************************************************************/
+unsigned commandOffset(const uint8_t* data, unsigned length, unsigned int index, uint8_t& patCode)
+{
+	unsigned pos = 0;
+
+	patCode = 0;
+	for (unsigned int n = 0; n < index && pos < length; n++)
+	{
+		if (data[pos] == 0xF9)
+		{
+			patCode = data[pos + 1];
+		}
+		pos = nextCommand(data, length, pos);
+	}
+
+	return pos;
+}
+
+/**************************************************************************
+** commandBounds
+**
+** The area of the 160x168 picture that the line or brush command at pos
+** can draw to, given the pattern code in force. Returns false for any
+** other command, as those affect everything drawn after them, and for
+** lines that stray far enough off the picture that their scaled end points
+** might wrap around.
+**************************************************************************/
+bool commandBounds(const uint8_t* data, unsigned pos, uint8_t patCode, Rect& bounds)
+{
+	uint8_t action = data[pos++];
+	int x, y;
+
+	bounds.left = bounds.top = bounds.right = bounds.bottom = 0;
 
-	fseek(file, 0L, SEEK_END);
-	tmp = ftell(file);
-	fseek(file, 0L, SEEK_SET);
+	switch (action) {
+	case 0xF4:
+	case 0xF5:
+		x = data[pos++];
+		y = data[pos++];
+		addPoint(bounds, x, y);
+		for (int n = 0; data[pos] < 0xF0; n++)
+		{
+			if ((n & 1) == (action == 0xF5 ? 0 : 1))
+				x = data[pos++];
+			else
+				y = data[pos++];
+			addPoint(bounds, x, y);
+		}
+		break;
+	case 0xF6:
+		x = data[pos++];
+		y = data[pos++];
+		addPoint(bounds, x, y);
+		while (data[pos] < 0xF0 && data[pos + 1] < 0xF0)
+		{
+			addPoint(bounds, data[pos], data[pos + 1]);
+			pos += 2;
+		}
+		break;
+	case 0xF7:
+		x = data[pos++];
+		y = data[pos++];
+		addPoint(bounds, x, y);
+		while (data[pos] < 0xF0)
+		{
+			uint8_t disp = data[pos++];
+			x += (disp & 0x80) ? -((disp >> 4) & 0x07) : ((disp >> 4) & 0x07);
+			y += (disp & 0x08) ? -(disp & 0x07) : (disp & 0x07);
+			addPoint(bounds, x, y);
+		}
+		break;
+	case 0xFA:
+		for (;;)
+		{
+			int penSize = patCode & 7;
+
+			if ((patCode & 0x20) && data[pos++] >= 0xF0) break;
+			if ((x = data[pos++]) >= 0xF0) break;
+			if ((y = data[pos++]) >= 0xF0) break;
+
+			if (x < (penSize / 2) + 1) x = (penSize / 2) + 1;
+			else if (x > 160 - ((penSize / 2) + 1)) x = 160 - ((penSize / 2) + 1);
+			if (y < penSize) y = penSize;
+			else if (y >= 168 - penSize) y = 167 - penSize;
+
+			addPoint(bounds, x - (penSize + 1) / 2, y - penSize);
+			addPoint(bounds, x + penSize / 2, y + penSize);
+		}
+		break;
+	default:
+		return false;
+	}
 
-	return(tmp);
+	return bounds.left >= 0 && bounds.top >= 0 && bounds.right <= 256 && bounds.bottom <= 256;
 }
 
 uint8_t EGAPalette[] = 
@@ -666,192 +2232,2644 @@ uint8_t EGAPalette[] =
 	0xff, 0xff, 0xff
 };
 
-void DumpToPNG(Bitmap* pic, const char* path)
+/**************************************************************************
+** RunPNGEncoder
+**
+** Writes indexed PNGs straight from the colour runs of a bitmap. Each run
+** becomes a literal followed by a distance 1 match, and a row identical
+** to the one above becomes a match one row back, so no LZ77 search is
+** needed. Tokens are Huffman coded in dynamic deflate blocks. Buffers
+** are kept between calls.
+**************************************************************************/
+class RunPNGEncoder
+{
+public:
+	void encode(Bitmap* pic, std::vector<uint8_t>& png);
+
+	// Compresses a rectangle of pic as filterless PNG scanlines into a
+	// zlib stream appended to out
+	void compress(Bitmap* pic, unsigned int left, unsigned int top, unsigned int width, unsigned int height, std::vector<uint8_t>& out);
+
+private:
+	// A literal byte when distance is 0, otherwise a match of length bytes
+	struct Token
+	{
+		uint16_t value;
+		uint16_t distance;
+	};
+
+	void rowRuns(Bitmap* pic, unsigned int left, unsigned int y, unsigned int width, std::vector<Run>& runs);
+	void addLiteral(uint8_t value);
+	void addRepeat(unsigned int length, unsigned int distance);
+	void addRunChecksum(uint8_t value, unsigned int length);
+	void writeBits(unsigned int value, int count);
+	void writeCode(unsigned int code, int length);
+	void writeBlock(const Token* blockTokens, size_t count, bool final);
+
+	std::vector<Token> tokens;
+	std::vector<Run> runs, previousRuns;
+	std::vector<uint8_t> scratch;
+
+	std::vector<uint8_t>* output;
+	uint64_t bitBuffer;
+	int bitCount;
+	uint32_t adlerA, adlerB;
+};
+
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t codeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static int lengthSymbol(unsigned int length)
+{
+	int n = 28;
+	while (lengthBase[n] > length) n--;
+	return n;
+}
+
+static int distanceSymbol(unsigned int distance)
+{
+	int n = 29;
+	while (distanceBase[n] > distance) n--;
+	return n;
+}
+
+// Canonical Huffman codes for the given code lengths, as in RFC 1951 3.2.2
+static void buildCodes(const unsigned* lengths, unsigned* codes, int count)
+{
+	unsigned lengthCount[16] = { 0 }, nextCode[16] = { 0 };
+	for (int n = 0; n < count; n++) lengthCount[lengths[n]]++;
+	lengthCount[0] = 0;
+	for (int bits = 1, code = 0; bits < 16; bits++)
+	{
+		code = (code + lengthCount[bits - 1]) << 1;
+		nextCode[bits] = code;
+	}
+	for (int n = 0; n < count; n++)
+	{
+		codes[n] = lengths[n] ? nextCode[lengths[n]]++ : 0;
+	}
+}
+
+static void appendChunk(std::vector<uint8_t>& png, const char* type, const uint8_t* data, size_t length)
+{
+	size_t start = png.size();
+	png.push_back((uint8_t)(length >> 24));
+	png.push_back((uint8_t)(length >> 16));
+	png.push_back((uint8_t)(length >> 8));
+	png.push_back((uint8_t)length);
+	png.insert(png.end(), type, type + 4);
+	png.insert(png.end(), data, data + length);
+	unsigned crc = lodepng_crc32(png.data() + start + 4, length + 4);
+	png.push_back((uint8_t)(crc >> 24));
+	png.push_back((uint8_t)(crc >> 16));
+	png.push_back((uint8_t)(crc >> 8));
+	png.push_back((uint8_t)crc);
+}
+
+static void appendWord(std::vector<uint8_t>& out, uint32_t value)
+{
+	out.push_back((uint8_t)(value >> 24));
+	out.push_back((uint8_t)(value >> 16));
+	out.push_back((uint8_t)(value >> 8));
+	out.push_back((uint8_t)value);
+}
+
+// The signature, IHDR and PLTE of an indexed PNG
+static void appendHeader(std::vector<uint8_t>& png, unsigned int width, unsigned int height)
+{
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	uint8_t header[13] =
+	{
+		(uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+		(uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+		8,	// Bit depth
+		3,	// Indexed colour
+		0, 0, 0
+	};
+
+	png.assign(signature, signature + 8);
+	appendChunk(png, "IHDR", header, 13);
+	appendChunk(png, "PLTE", EGAPalette, sizeof(EGAPalette));
+}
+
+// Compares runs field by field, as the padding in Run isn't initialised
+static bool sameRuns(const std::vector<Run>& a, const std::vector<Run>& b)
+{
+	if (a.size() != b.size())
+	{
+		return false;
+	}
+	for (size_t n = 0; n < a.size(); n++)
+	{
+		if (a[n].end != b[n].end || a[n].colour != b[n].colour)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void RunPNGEncoder::rowRuns(Bitmap* pic, unsigned int left, unsigned int y, unsigned int width, std::vector<Run>& runs)
+{
+	runs.clear();
+
+	if (!pic->data)
+	{
+		const std::vector<Run>& row = pic->rows[y];
+		size_t n = pic->FindRun(left, y);
+		for (; n < row.size() && row[n].end - left < width; n++)
+		{
+			Run run = { row[n].end - left, row[n].colour };
+			runs.push_back(run);
+		}
+		Run last = { width, row[n < row.size() ? n : row.size() - 1].colour };
+		runs.push_back(last);
+		return;
+	}
+
+	const uint8_t* pixels = pic->data + y * pic->width + left;
+	for (unsigned int x = 0; x < width; x++)
+	{
+		appendRun(runs, x + 1, pixels[x]);
+	}
+}
+
+void RunPNGEncoder::addLiteral(uint8_t value)
+{
+	Token token = { value, 0 };
+	tokens.push_back(token);
+}
+
+// Copies length bytes from distance bytes back, as matches of at most 258
+// bytes and literals for anything too short to match
+void RunPNGEncoder::addRepeat(unsigned int length, unsigned int distance)
+{
+	while (length >= 3)
+	{
+		unsigned int count = length > 258 ? 258 : length;
+		if (length - count > 0 && length - count < 3) count = length - 3;
+		Token token = { (uint16_t)count, (uint16_t)distance };
+		tokens.push_back(token);
+		length -= count;
+	}
+	// Runs too short to match are repeated literals. Row repeats are always
+	// long enough, so the last token is the literal being repeated.
+	for (; length; length--)
+	{
+		tokens.push_back(tokens.back());
+	}
+}
+
+// Updates the Adler-32 checksum for length copies of value
+void RunPNGEncoder::addRunChecksum(uint8_t value, unsigned int length)
+{
+	uint64_t a = adlerA, b = adlerB;
+	b = (b + (uint64_t)length * a + (uint64_t)value * length * (length + 1) / 2) % 65521;
+	a = (a + (uint64_t)value * length) % 65521;
+	adlerA = (uint32_t)a;
+	adlerB = (uint32_t)b;
+}
+
+void RunPNGEncoder::writeBits(unsigned int value, int count)
+{
+	bitBuffer |= (uint64_t)value << bitCount;
+	bitCount += count;
+	while (bitCount >= 8)
+	{
+		output->push_back((uint8_t)bitBuffer);
+		bitBuffer >>= 8;
+		bitCount -= 8;
+	}
+}
+
+// Huffman codes are stored most significant bit first
+void RunPNGEncoder::writeCode(unsigned int code, int length)
+{
+	unsigned int reversed = 0;
+	for (int n = 0; n < length; n++)
+	{
+		reversed = (reversed << 1) | ((code >> n) & 1);
+	}
+	writeBits(reversed, length);
+}
+
+void RunPNGEncoder::writeBlock(const Token* blockTokens, size_t count, bool final)
 {
-	std::vector<uint8_t> data;
+	unsigned litFrequency[286] = { 0 }, distFrequency[30] = { 0 };
+	unsigned litLengths[286], distLengths[30], litCodes[286], distCodes[30];
+
+	for (size_t n = 0; n < count; n++)
+	{
+		if (blockTokens[n].distance)
+		{
+			litFrequency[257 + lengthSymbol(blockTokens[n].value)]++;
+			distFrequency[distanceSymbol(blockTokens[n].distance)]++;
+		}
+		else
+		{
+			litFrequency[blockTokens[n].value]++;
+		}
+	}
+	litFrequency[256] = 1;
+
+	lodepng_huffman_code_lengths(litLengths, litFrequency, 286, 15);
+	lodepng_huffman_code_lengths(distLengths, distFrequency, 30, 15);
+	buildCodes(litLengths, litCodes, 286);
+	buildCodes(distLengths, distCodes, 30);
+
+	int litCount = 286, distCount = 30;
+	while (litCount > 257 && !litLengths[litCount - 1]) litCount--;
+	while (distCount > 1 && !distLengths[distCount - 1]) distCount--;
+
+	// Run length encode the code lengths with symbols 16, 17 and 18
+	unsigned allLengths[286 + 30];
+	int lengthCount = 0;
+	for (int n = 0; n < litCount; n++) allLengths[lengthCount++] = litLengths[n];
+	for (int n = 0; n < distCount; n++) allLengths[lengthCount++] = distLengths[n];
+
+	uint8_t clSymbols[286 + 30], clExtra[286 + 30];
+	int clCount = 0;
+	unsigned clFrequency[19] = { 0 };
+	for (int n = 0; n < lengthCount;)
+	{
+		int repeat = 1;
+		while (n + repeat < lengthCount && allLengths[n + repeat] == allLengths[n]) repeat++;
+		n += repeat;
+
+		if (allLengths[n - repeat] == 0)
+		{
+			while (repeat >= 11)
+			{
+				int chunk = repeat > 138 ? 138 : repeat;
+				clSymbols[clCount] = 18; clExtra[clCount++] = chunk - 11;
+				repeat -= chunk;
+			}
+			if (repeat >= 3)
+			{
+				clSymbols[clCount] = 17; clExtra[clCount++] = repeat - 3;
+				repeat = 0;
+			}
+		}
+		else
+		{
+			clSymbols[clCount] = allLengths[n - repeat]; clExtra[clCount++] = 0;
+			repeat--;
+			while (repeat >= 3)
+			{
+				int chunk = repeat > 6 ? 6 : repeat;
+				clSymbols[clCount] = 16; clExtra[clCount++] = chunk - 3;
+				repeat -= chunk;
+			}
+		}
+		for (; repeat; repeat--)
+		{
+			clSymbols[clCount] = allLengths[n - 1]; clExtra[clCount++] = 0;
+		}
+	}
+	for (int n = 0; n < clCount; n++) clFrequency[clSymbols[n]]++;
+
+	unsigned clLengths[19], clCodes[19];
+	lodepng_huffman_code_lengths(clLengths, clFrequency, 19, 7);
+	buildCodes(clLengths, clCodes, 19);
+
+	int orderCount = 19;
+	while (orderCount > 4 && !clLengths[codeLengthOrder[orderCount - 1]]) orderCount--;
+
+	writeBits(final ? 1 : 0, 1);
+	writeBits(2, 2);
+	writeBits(litCount - 257, 5);
+	writeBits(distCount - 1, 5);
+	writeBits(orderCount - 4, 4);
+	for (int n = 0; n < orderCount; n++) writeBits(clLengths[codeLengthOrder[n]], 3);
+	for (int n = 0; n < clCount; n++)
+	{
+		writeCode(clCodes[clSymbols[n]], clLengths[clSymbols[n]]);
+		if (clSymbols[n] == 16) writeBits(clExtra[n], 2);
+		else if (clSymbols[n] == 17) writeBits(clExtra[n], 3);
+		else if (clSymbols[n] == 18) writeBits(clExtra[n], 7);
+	}
+
+	for (size_t n = 0; n < count; n++)
+	{
+		const Token& token = blockTokens[n];
+		if (!token.distance)
+		{
+			writeCode(litCodes[token.value], litLengths[token.value]);
+			continue;
+		}
+		int length = lengthSymbol(token.value);
+		writeCode(litCodes[257 + length], litLengths[257 + length]);
+		writeBits(token.value - lengthBase[length], lengthExtra[length]);
+		int distance = distanceSymbol(token.distance);
+		writeCode(distCodes[distance], distLengths[distance]);
+		writeBits(token.distance - distanceBase[distance], distanceExtra[distance]);
+	}
+	writeCode(litCodes[256], litLengths[256]);
+}
+
+void RunPNGEncoder::compress(Bitmap* pic, unsigned int left, unsigned int top, unsigned int width, unsigned int height, std::vector<uint8_t>& out)
+{
+	const size_t blockTokens = 1 << 16;
+	unsigned int rowLength = width + 1;
+
+	tokens.clear();
+	adlerA = 1;
+	adlerB = 0;
+
+	for (unsigned int y = top; y < top + height; y++)
+	{
+		rowRuns(pic, left, y, width, runs);
+
+		if (y > top && rowLength >= 3 && rowLength <= 32768 && sameRuns(runs, previousRuns))
+		{
+			addRepeat(rowLength, rowLength);
+		}
+		else
+		{
+			unsigned int start = 0;
+			addLiteral(0);
+			for (size_t n = 0; n < runs.size(); n++)
+			{
+				addLiteral(runs[n].colour);
+				addRepeat(runs[n].end - start - 1, 1);
+				start = runs[n].end;
+			}
+		}
+
+		addRunChecksum(0, 1);
+		unsigned int start = 0;
+		for (size_t n = 0; n < runs.size(); n++)
+		{
+			addRunChecksum(runs[n].colour, runs[n].end - start);
+			start = runs[n].end;
+		}
+
+		runs.swap(previousRuns);
+	}
+
+	output = &out;
+	bitBuffer = 0;
+	bitCount = 0;
+
+	out.push_back(0x78);
+	out.push_back(0x01);
+	for (size_t n = 0; n == 0 || n < tokens.size(); n += blockTokens)
+	{
+		size_t count = tokens.size() - n < blockTokens ? tokens.size() - n : blockTokens;
+		writeBlock(tokens.data() + n, count, n + blockTokens >= tokens.size());
+	}
+	if (bitCount)
+	{
+		writeBits(0, 8 - bitCount);
+	}
+	appendWord(out, (adlerB << 16) | adlerA);
+}
+
+void RunPNGEncoder::encode(Bitmap* pic, std::vector<uint8_t>& png)
+{
+	appendHeader(png, pic->width, pic->height);
+
+	scratch.clear();
+	compress(pic, 0, 0, pic->width, pic->height, scratch);
+	appendChunk(png, "IDAT", scratch.data(), scratch.size());
+	appendChunk(png, "IEND", nullptr, 0);
+}
+
+RunPNGEncoder runEncoder;
+
+/**************************************************************************
+** verifyPNG
+**
+** Decodes a PNG with lodepng and checks it against the bitmap.
+**************************************************************************/
+bool verifyPNG(Bitmap* pic, const std::vector<uint8_t>& png)
+{
+	std::vector<uint8_t> decoded, scratch(pic->width);
+	unsigned width, height;
+
+	if (lodepng::decode(decoded, width, height, png) || width != pic->width || height != pic->height)
+	{
+		return false;
+	}
+
+	for (unsigned int y = 0; y < height; y++)
+	{
+		const uint8_t* row = pic->GetRow(y, scratch.data());
+		const uint8_t* pixel = decoded.data() + y * width * 4;
+
+		for (unsigned int x = 0; x < width; x++, pixel += 4)
+		{
+			if (memcmp(pixel, EGAPalette + row[x] * 3, 3) || pixel[3] != 0xff)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void encodePNG(Bitmap* pic, std::vector<uint8_t>& png)
+{
+	if (options.pngEncoder == PNG_RUNS)
+	{
+		runEncoder.encode(pic, png);
+	}
+	else
+	{
+		// Kept to the EGA palette in order, as with the run encoder, so that
+		// each pixel's index is its colour or priority rather than whatever
+		// lodepng would pick
+		lodepng::State state;
+		std::vector<uint8_t> data;
+
+		std::vector<uint8_t> scratch(pic->width);
+
+		state.encoder.auto_convert = 0;
+		state.info_raw.colortype = LCT_PALETTE;
+		state.info_raw.bitdepth = 8;
+		state.info_png.color.colortype = LCT_PALETTE;
+		state.info_png.color.bitdepth = 4;
+		for (int n = 0; n < 16; n++)
+		{
+			lodepng_palette_add(&state.info_raw, EGAPalette[n * 3], EGAPalette[n * 3 + 1], EGAPalette[n * 3 + 2], 0xff);
+			lodepng_palette_add(&state.info_png.color, EGAPalette[n * 3], EGAPalette[n * 3 + 1], EGAPalette[n * 3 + 2], 0xff);
+		}
+
+		for(unsigned int y = 0; y < pic->height; y++)
+		{
+			const uint8_t* row = pic->GetRow(y, scratch.data());
+			data.insert(data.end(), row, row + pic->width);
+		}
+		
+		lodepng::encode(png, data, pic->width, pic->height, state);
+	}
+}
+
+// Adds a tEXt chunk straight after the IHDR chunk
+static void insertText(std::vector<uint8_t>& png, const char* keyword, const char* text)
+{
+	std::vector<uint8_t> data, chunk;
+
+	data.insert(data.end(), keyword, keyword + strlen(keyword) + 1);
+	data.insert(data.end(), text, text + strlen(text));
+	appendChunk(chunk, "tEXt", data.data(), data.size());
+	png.insert(png.begin() + 33, chunk.begin(), chunk.end());
+}
+
+// Saves a picture, with provenance saying how it was drawn if it's given
+void DumpToPNG(Bitmap* pic, const char* path, const char* provenance = nullptr)
+{
+	std::vector<uint8_t> png;
+	clock_t start = clock();
+
+	encodePNG(pic, png);
+	if (provenance)
+	{
+		insertText(png, PROVENANCE_KEYWORD, provenance);
+	}
+
+	double encodeTime = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	lodepng::save_file(png, path);
+
+	if (options.pngStats)
+	{
+		// Compared with the scanlines of a byte per pixel image, filter
+		// bytes included, whichever encoder was used
+		double rawSize = (double)(pic->width + 1) * pic->height;
+		printf("%s: %u bytes, %.1f:1, encoded in %.2f ms\n", path, (unsigned)png.size(), rawSize / png.size(), encodeTime);
+	}
+	if (options.verifyPNG && !verifyPNG(pic, png))
+	{
+		printf("%s: decoded image doesn't match\n", path);
+	}
+}
+
+/**************************************************************************
+** APNGWriter
+**
+** Builds an animated PNG of a picture being drawn. The first frame is the
+** whole picture, and each frame after it only holds the rectangle that
+** changed since the frame before, drawn over what is already there.
+** Frames are compressed with runEncoder as they are added.
+**************************************************************************/
+class APNGWriter
+{
+public:
+	void begin(Bitmap* pic);
+	void addFrame(Bitmap* pic, const Rect& area);
+	void save(const char* path);
+
+private:
+	std::vector<uint8_t> frames, chunk, png;
+	unsigned int width, height;
+	unsigned int frameCount, sequence;
+};
+
+APNGWriter apngWriter;
+
+void APNGWriter::begin(Bitmap* pic)
+{
+	Rect whole = { 0, 0, (int)pic->width, (int)pic->height };
+
+	width = pic->width;
+	height = pic->height;
+	frameCount = 0;
+	sequence = 0;
+	frames.clear();
+	addFrame(pic, whole);
+}
+
+void APNGWriter::addFrame(Bitmap* pic, const Rect& area)
+{
+	unsigned int frameWidth = area.right - area.left, frameHeight = area.bottom - area.top;
+
+	chunk.clear();
+	appendWord(chunk, sequence++);
+	appendWord(chunk, frameWidth);
+	appendWord(chunk, frameHeight);
+	appendWord(chunk, area.left);
+	appendWord(chunk, area.top);
+	chunk.push_back(0);
+	chunk.push_back(ANIMATION_FRAME_DELAY);
+	chunk.push_back(0);
+	chunk.push_back(100);
+	chunk.push_back(0);	// Leave the frame in place for the next one
+	chunk.push_back(0);	// Replace the pixels under the frame
+	appendChunk(frames, "fcTL", chunk.data(), chunk.size());
+
+	// The first frame is the default image, the rest are numbered fdAT
+	// chunks
+	chunk.clear();
+	if (frameCount)
+	{
+		appendWord(chunk, sequence++);
+	}
+	runEncoder.compress(pic, area.left, area.top, frameWidth, frameHeight, chunk);
+	appendChunk(frames, frameCount ? "fdAT" : "IDAT", chunk.data(), chunk.size());
+	frameCount++;
+}
+
+void APNGWriter::save(const char* path)
+{
+	appendHeader(png, width, height);
+	chunk.clear();
+	appendWord(chunk, frameCount);
+	appendWord(chunk, 1);	// Play once, ending on the finished picture
+	appendChunk(png, "acTL", chunk.data(), chunk.size());
+	png.insert(png.end(), frames.begin(), frames.end());
+	appendChunk(png, "IEND", nullptr, 0);
+
+	lodepng::save_file(png, path);
+
+	if (options.pngStats)
+	{
+		printf("%s: %u frames, %u bytes\n", path, frameCount, (unsigned)png.size());
+	}
+}
+
+/**************************************************************************
+** DumpPriority
+**
+** Saves a priority screen in the format chosen with -priority, adding the
+** file extension to name. Only PNGs have room for the provenance.
+**************************************************************************/
+void DumpPriority(Bitmap* pic, const char* name, const char* provenance = nullptr)
+{
+	char path[32];
+
+	if (options.priorityOutput == PRIORITY_PNG)
+	{
+		sprintf(path, "%s.png", name);
+		DumpToPNG(pic, path, provenance);
+		return;
+	}
+
+	sprintf(path, "%s.raw", name);
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		printf("Error opening file : %s\n", path);
+		return;
+	}
+
+	std::vector<uint8_t> scratch(pic->width);
+	for (unsigned int y = 0; y < pic->height; y++)
+	{
+		fwrite(pic->GetRow(y, scratch.data()), 1, pic->width, file);
+	}
+	fclose(file);
+}
+
+uint8_t PicDrawer::getReferencePicture(word x, word y)
+{
+	if (x >= picture->width || y >= picture->height)
+	{
+		return referenceDrawer->picture->clearColour;
+	}
+	return referenceDrawer->picture->Get(refX[x], refY[y]);
+}
+
+uint8_t PicDrawer::getReferencePriority(word x, word y)
+{
+	if (x >= picture->width || y >= picture->height)
+	{
+		return referenceDrawer->priority->clearColour;
+	}
+	return referenceDrawer->priority->Get(refX[x], refY[y]);
+}
+
+/**************************************************************************
+** PicDrawer
+**
+** A drawer made without a priority plane never draws priority, and skips
+** the commands that only draw priority. Its picture comes out the same,
+** as drawing the picture never reads the priority. It can't be used as a
+** reference drawer or verify fills, as those need the priority plane.
+**************************************************************************/
+PicDrawer::PicDrawer(unsigned int width, unsigned int height, bool runLength, bool withPriority)
+{
+	picScaleX = (float)width / 160.0f;
+	picScaleY = (float)height / 168.0f;
+
+	picture = new Bitmap(width, height, 15, runLength);
+	priority = withPriority ? new Bitmap(width, height, 4, runLength) : nullptr;
+	rowScratch.resize(width);
+	// A row never holds more than width runs or spans, so these are sized
+	// once rather than grown while drawing
+	fillSpans.reserve(width);
+	gapRuns.reserve(width);
+	gapScratchRuns.reserve(width);
+	gapColours.reserve(width);
+	gapReplacement.reserve(width);
+	clipRight = width;
+	clipBottom = height;
+
+	fillStride = (width + 63) / 64;
+	lastFill = new uint64_t[fillStride * height];
+	memset(lastFill, 0, fillStride * height * sizeof(uint64_t));
+	fillRowMin = height;
+	fillRowMax = -1;
+
+	// Only some drawers use these, but they're small next to the planes and
+	// making them here keeps drawing from allocating
+	fillNeighbourhood = new uint64_t[fillStride * height];
+	memset(fillNeighbourhood, 0, fillStride * height * sizeof(uint64_t));
+	neighbourhoodRowMin = height;
+	neighbourhoodRowMax = -1;
+	fillableMask = new uint64_t[fillStride * height];
+	fillRegion = new uint64_t[fillStride * height];
+
+	refX = new word[width];
+	refY = new word[height];
+	for (unsigned int i = 0; i < width; i++)
+	{
+		refX[i] = (word)(i / picScaleX);
+	}
+	for (unsigned int j = 0; j < height; j++)
+	{
+		refY[j] = (word)(j / picScaleY);
+	}
+}
+
+PicDrawer::~PicDrawer()
+{
+	delete picture;
+	delete priority;
+	delete[] lastFill;
+	delete[] fillNeighbourhood;
+	delete[] fillableMask;
+	delete[] fillRegion;
+	delete[] refX;
+	delete[] refY;
+}
+
+/**************************************************************************
+** reset
+**
+** Puts the drawer back in the state it was constructed in, ready for
+** another picture, but keeps all of its buffers. The reference drawer
+** and the fill settings are kept too.
+**************************************************************************/
+void PicDrawer::reset()
+{
+	picture->Clear();
+	if (priority)
+	{
+		priority->Clear();
+	}
+	clearFills();
+	fillFrontier.clear();
+
+	pictureData = pictureDataPtr = nullptr;
+	pictureDataLength = 0;
+	isDrawing = false;
+	commandCount = 0;
+	checkpoints.clear();
+	fillRecords.clear();
+
+	clipLeft = clipTop = 0;
+	clipRight = picture->width;
+	clipBottom = picture->height;
+	regionOnly = false;
+	dirty = Rect();
+
+	picDrawEnabled = priDrawEnabled = false;
+	picColour = priColour = patCode = patNum = 0;
+	rpos = spos = 0;
+}
+
+void PicDrawer::markFill(word x, word y)
+{
+	lastFill[y * fillStride + (x >> 6)] |= (uint64_t)1 << (x & 63);
+	if (y < fillRowMin) fillRowMin = y;
+	if (y > fillRowMax) fillRowMax = y;
+}
+
+/**************************************************************************
+** clearFills
+**
+** Forgets the pixels set by the previous fill command. Only the rows that
+** were touched get cleared, so small fills stay cheap on large pictures.
+**************************************************************************/
+void PicDrawer::clearFills()
+{
+	if (fillRowMin <= fillRowMax)
+	{
+		memset(lastFill + fillRowMin * fillStride, 0, (fillRowMax - fillRowMin + 1) * fillStride * sizeof(uint64_t));
+	}
+	fillRowMin = picture->height;
+	fillRowMax = -1;
+}
+
+bool PicDrawer::didFill(word x, word y)
+{
+	if (x >= picture->width || y >= picture->height)
+	{
+		return false;
+	}
+	return (lastFill[y * fillStride + (x >> 6)] >> (x & 63)) & 1;
+}
+
+/**************************************************************************
+** buildFillNeighbourhood
+**
+** Marks every pixel that the last fill set or that is next to one,
+** including diagonally. Rows are dilated a word at a time, carrying the
+** edge bits across word boundaries.
+**************************************************************************/
+void PicDrawer::buildFillNeighbourhood()
+{
+	int height = picture->height;
+
+	if (neighbourhoodRowMin <= neighbourhoodRowMax)
+	{
+		memset(fillNeighbourhood + neighbourhoodRowMin * fillStride, 0, (neighbourhoodRowMax - neighbourhoodRowMin + 1) * fillStride * sizeof(uint64_t));
+	}
+
+	if (fillRowMin > fillRowMax)
+	{
+		neighbourhoodRowMin = height;
+		neighbourhoodRowMax = -1;
+		return;
+	}
+
+	neighbourhoodRowMin = fillRowMin > 0 ? fillRowMin - 1 : 0;
+	neighbourhoodRowMax = fillRowMax < height - 1 ? fillRowMax + 1 : height - 1;
+
+	for (int y = fillRowMin; y <= fillRowMax; y++)
+	{
+		const uint64_t* row = lastFill + y * fillStride;
+
+		for (unsigned n = 0; n < fillStride; n++)
+		{
+			uint64_t bits = row[n];
+			uint64_t spread = bits | (bits << 1) | (bits >> 1);
+			if (n > 0) spread |= row[n - 1] >> 63;
+			if (n < fillStride - 1) spread |= row[n + 1] << 63;
+
+			if (!spread)
+				continue;
+
+			for (int j = y - 1; j <= y + 1; j++)
+			{
+				if (j >= 0 && j < height)
+				{
+					fillNeighbourhood[j * fillStride + n] |= spread;
+				}
+			}
+		}
+	}
+}
+
+/**************************************************************************
+** didReferenceFill
+**
+** Returns whether the reference drawer's last fill set this pixel or any
+** of its neighbours, after mapping the pixel to reference coordinates.
+**************************************************************************/
+bool PicDrawer::didReferenceFill(word x, word y)
+{
+	if (x >= picture->width || y >= picture->height)
+	{
+		return false;
+	}
+
+	word scaledX = refX[x];
+	word scaledY = refY[y];
+
+	return (referenceDrawer->fillNeighbourhood[scaledY * referenceDrawer->fillStride + (scaledX >> 6)] >> (scaledX & 63)) & 1;
+}
+
+void PicDrawer::beginDrawing(const uint8_t* inData, unsigned length)
+{
+	pictureDataPtr = pictureData = inData;
+	pictureDataLength = length;
+	isDrawing = (length > 0);
+	commandCount = 0;
+	dirty = Rect();
+
+	fillRecords.clear();
+	checkpoints.clear();
+	if (checkpointInterval)
+	{
+		takeCheckpoint();
+	}
+}
+
+bool PicDrawer::drawStep()
+{
+	dirty = Rect();
+	if (!isDrawing)
+	{
+		return false;
+	}
+
+	return runCommand();
+}
+
+/**************************************************************************
+** drawAll
+**
+** Draws the rest of the picture in one go. A drawer with a reference
+** drawer runs it alongside, one command at a time, just as calling
+** drawStep on the pair would.
+**************************************************************************/
+void PicDrawer::drawAll()
+{
+	if (referenceDrawer)
+	{
+		while (stepWithReference())
+		{
+		}
+		return;
+	}
+
+	while (isDrawing)
+	{
+		runCommand();
+	}
+}
+
+/**************************************************************************
+** stepWithReference
+**
+** Runs the next command on the reference drawer and then on this one.
+** Returns false once the reference drawer has finished, in which case
+** this drawer doesn't run the command either.
+**************************************************************************/
+bool PicDrawer::stepWithReference()
+{
+	if (!referenceDrawer->isDrawing || !referenceDrawer->runCommand())
+	{
+		return false;
+	}
+
+	if (isDrawing)
+	{
+		runCommand();
+	}
+	return true;
+}
+
+/**************************************************************************
+** enableCheckpoints
+**
+** Keeps a checkpoint every interval commands from the next beginDrawing,
+** so that seekToCommand never has to run more than interval commands.
+** A reference drawer gets checkpoints at the same interval, as it has to
+** be seeked too. An interval of 0 turns checkpoints off.
+**************************************************************************/
+void PicDrawer::enableCheckpoints(unsigned int interval)
+{
+	checkpointInterval = interval;
+	checkpoints.clear();
+	if (referenceDrawer)
+	{
+		referenceDrawer->enableCheckpoints(interval);
+	}
+}
+
+/**************************************************************************
+** seekToCommand
+**
+** Leaves the drawer as it would be after running the first index commands.
+** Seeking forwards carries on from the current command, or from a later
+** checkpoint. Seeking backwards needs checkpoints. A reference drawer is
+** seeked along with this one. Returns false if the picture has fewer
+** commands, or if there is no checkpoint to seek back to. Seeking to the
+** reference drawer's full command count finishes the picture, even though
+** the upscaled drawer never runs the command that ends it.
+**************************************************************************/
+bool PicDrawer::seekToCommand(unsigned int index)
+{
+	dirty = Rect();
+	if (checkpointInterval && !checkpoints.empty())
+	{
+		size_t n = index / checkpointInterval;
+		if (n >= checkpoints.size())
+		{
+			n = checkpoints.size() - 1;
+		}
+
+		const Checkpoint& checkpoint = checkpoints[n];
+		if (index < commandCount || checkpoint.commandCount > commandCount)
+		{
+			Rect whole = { 0, 0, (int)picture->width, (int)picture->height };
+			restoreCheckpoint(checkpoint, whole);
+			if (referenceDrawer && !referenceDrawer->seekToCommand(commandCount))
+			{
+				return false;
+			}
+		}
+	}
+
+	if (index < commandCount)
+	{
+		return false;
+	}
+
+	while (commandCount < index && isDrawing)
+	{
+		if (referenceDrawer)
+		{
+			if (!stepWithReference())
+				break;
+		}
+		else
+		{
+			runCommand();
+		}
+	}
+
+	if (referenceDrawer && !referenceDrawer->isDrawing && referenceDrawer->commandCount == index)
+	{
+		return true;
+	}
+	return commandCount == index;
+}
+
+/**************************************************************************
+** takeCheckpoint
+**
+** Adds a checkpoint of the current state. Rows that match the previous
+** checkpoint are shared with it rather than copied, which keeps the cost
+** down to the rows the commands in between drew on.
+**************************************************************************/
+static void checkpointPlane(Bitmap* plane, const PlaneRows* previous, PlaneRows& rows, std::vector<uint8_t>& scratch)
+{
+	rows.resize(plane->height);
+	for (unsigned int y = 0; y < plane->height; y++)
+	{
+		const uint8_t* row = plane->GetRow(y, scratch.data());
+
+		if (previous && !memcmp((*previous)[y]->data(), row, plane->width))
+		{
+			rows[y] = (*previous)[y];
+		}
+		else
+		{
+			rows[y] = std::make_shared<const std::vector<uint8_t> >(row, row + plane->width);
+		}
+	}
+}
+
+void PicDrawer::takeCheckpoint()
+{
+	Checkpoint checkpoint;
+	const Checkpoint* previous = checkpoints.empty() ? NULL : &checkpoints.back();
+
+	checkpoint.commandCount = commandCount;
+	checkpoint.offset = (unsigned int)(pictureDataPtr - pictureData);
+	checkpoint.isDrawing = isDrawing;
+	checkpoint.picDrawEnabled = picDrawEnabled;
+	checkpoint.priDrawEnabled = priDrawEnabled;
+	checkpoint.picColour = picColour;
+	checkpoint.priColour = priColour;
+	checkpoint.patCode = patCode;
+	checkpoint.patNum = patNum;
+
+	rowScratch.resize(picture->width);
+	checkpointPlane(picture, previous ? &previous->pictureRows : NULL, checkpoint.pictureRows, rowScratch);
+	if (priority)
+	{
+		checkpointPlane(priority, previous ? &previous->priorityRows : NULL, checkpoint.priorityRows, rowScratch);
+	}
+
+	checkpoints.push_back(checkpoint);
+}
+
+void PicDrawer::restoreCheckpoint(const Checkpoint& checkpoint, const Rect& area)
+{
+	commandCount = checkpoint.commandCount;
+	pictureDataPtr = pictureData + checkpoint.offset;
+	isDrawing = checkpoint.isDrawing;
+	picDrawEnabled = checkpoint.picDrawEnabled;
+	priDrawEnabled = checkpoint.priDrawEnabled;
+	picColour = checkpoint.picColour;
+	priColour = checkpoint.priColour;
+	patCode = checkpoint.patCode;
+	patNum = checkpoint.patNum;
+	unionRect(dirty, area);
+
+	if (area.left == 0 && area.right == (int)picture->width)
+	{
+		for (int y = area.top; y < area.bottom; y++)
+		{
+			picture->SetRow(y, checkpoint.pictureRows[y]->data());
+			if (priority)
+			{
+				priority->SetRow(y, checkpoint.priorityRows[y]->data());
+			}
+		}
+		return;
+	}
+
+	// Only part of each row is restored, so patch it into the current row
+	rowScratch.resize(picture->width);
+	for (int y = area.top; y < area.bottom; y++)
+	{
+		for (int plane = 0; plane < (priority ? 2 : 1); plane++)
+		{
+			Bitmap* bitmap = plane ? priority : picture;
+			const PlaneRows& rows = plane ? checkpoint.priorityRows : checkpoint.pictureRows;
+			const uint8_t* row = bitmap->GetRow(y, rowScratch.data());
+
+			if (row != rowScratch.data())
+			{
+				memcpy(rowScratch.data(), row, picture->width);
+			}
+			memcpy(rowScratch.data() + area.left, rows[y]->data() + area.left, area.right - area.left);
+			bitmap->SetRow(y, rowScratch.data());
+		}
+	}
+}
+
+/**************************************************************************
+** redrawEdited
+**
+** Brings the drawer up to date after the command at index has been
+** replaced, with inData holding the edited picture. The commands before
+** and after the edited one must be unchanged. Needs checkpoints, and
+** drives the reference drawer too. The old picture data must still be
+** intact, so inData has to be a separate buffer. Edited data that doesn't
+** pass validatePicture is refused.
+**
+** Drawing restarts from the last checkpoint before the edit. If no fill
+** from there on reads or draws anywhere near the old or new extent of
+** the edited command, nothing outside that area can change, so only
+** that area is restored and redrawn. Otherwise everything from the
+** checkpoint is redrawn. fillGaps needs calling again afterwards.
+**************************************************************************/
+RedrawResult PicDrawer::redrawEdited(unsigned int index, const uint8_t* inData, unsigned length)
+{
+	PicDrawer* base = referenceDrawer ? referenceDrawer : this;
+
+	dirty = base->dirty = Rect();
+	if (!checkpointInterval || checkpoints.empty() || base->checkpoints.size() < checkpoints.size())
+	{
+		return REDRAW_FAILED;
+	}
+
+	// The commands are walked below without checking for the end of the data
+	unsigned problemOffset;
+	if (validatePicture(inData, length, problemOffset))
+	{
+		return REDRAW_FAILED;
+	}
+
+	uint8_t oldPatCode, newPatCode;
+	unsigned oldStart = commandOffset(pictureData, pictureDataLength, index, oldPatCode);
+	unsigned newStart = commandOffset(inData, length, index, newPatCode);
+
+	if (oldStart != newStart || oldStart >= pictureDataLength || newStart >= length
+		|| memcmp(pictureData, inData, oldStart))
+	{
+		return REDRAW_FAILED;
+	}
+
+	unsigned oldEnd = nextCommand(pictureData, pictureDataLength, oldStart);
+	unsigned newEnd = nextCommand(inData, length, newStart);
+
+	size_t n = index / checkpointInterval;
+	if (n >= checkpoints.size())
+	{
+		n = checkpoints.size() - 1;
+	}
+	unsigned int first = checkpoints[n].commandCount;
+
+	// The area the edit can touch, in 160x168 picture coordinates, with a
+	// pixel to spare for fillGaps looking either side
+	Rect oldBounds = { 0, 0, 0, 0 }, newBounds = { 0, 0, 0, 0 };
+	bool bounded = (pictureDataLength - oldEnd == length - newEnd)
+		&& !memcmp(pictureData + oldEnd, inData + newEnd, length - newEnd)
+		&& commandBounds(pictureData, oldStart, oldPatCode, oldBounds)
+		&& commandBounds(inData, newStart, newPatCode, newBounds);
+
+	Rect edited = oldBounds;
+	unionRect(edited, newBounds);
+	if (!edited.empty())
+	{
+		edited = growRect(edited, 1);
+	}
+
+	// The upscaled fills reach a little beyond the base fills they follow
+	int margin = referenceDrawer ? 2 + fillIterations : 1;
+
+	for (size_t m = 0; bounded && m < base->fillRecords.size(); m++)
+	{
+		if (base->fillRecords[m].command >= first && intersects(growRect(base->fillRecords[m].bounds, margin), edited))
+		{
+			bounded = false;
+		}
+	}
+
+	if (bounded)
+	{
+		if (referenceDrawer)
+		{
+			referenceDrawer->redrawRegion(n, edited, inData, length);
+		}
+		redrawRegion(n, edited, inData, length);
+		return REDRAW_REGION;
+	}
+
+	PicDrawer* drawers[2] = { this, referenceDrawer };
+
+	for (int d = 0; d < 2 && drawers[d]; d++)
+	{
+		PicDrawer* drawer = drawers[d];
+
+		drawer->checkpoints.resize(n + 1);
+		while (!drawer->fillRecords.empty() && drawer->fillRecords.back().command >= first)
+		{
+			drawer->fillRecords.pop_back();
+		}
+
+		Rect whole = { 0, 0, (int)drawer->picture->width, (int)drawer->picture->height };
+		drawer->pictureData = inData;
+		drawer->pictureDataLength = length;
+		drawer->restoreCheckpoint(drawer->checkpoints[n], whole);
+	}
+
+	drawAll();
+	return REDRAW_FULL;
+}
+
+/**************************************************************************
+** redrawRegion
+**
+** Restores area from the given checkpoint and runs the rest of the
+** picture with drawing clipped to it and fills skipped. area is in 160x168
+** picture coordinates. Checkpoints after this one are dropped as the rest
+** of the picture is already in its final state.
+**************************************************************************/
+void PicDrawer::redrawRegion(size_t checkpoint, const Rect& area, const uint8_t* inData, unsigned length)
+{
+	Rect clip = scaleRect(area);
+
+	checkpoints.resize(checkpoint + 1);
+	pictureData = inData;
+	pictureDataLength = length;
+	restoreCheckpoint(checkpoints[checkpoint], clip);
+
+	clipLeft = clip.left;
+	clipTop = clip.top;
+	clipRight = clip.right;
+	clipBottom = clip.bottom;
+	regionOnly = true;
+
+	while (isDrawing)
+	{
+		runCommand();
+	}
+
+	clipLeft = clipTop = 0;
+	clipRight = picture->width;
+	clipBottom = picture->height;
+	regionOnly = false;
+}
+
+/**************************************************************************
+** scaleRect
+**
+** The area of this drawer covering a rectangle of the 160x168 picture,
+** limited to the drawer's size.
+**************************************************************************/
+Rect PicDrawer::scaleRect(const Rect& rect)
+{
+	Rect scaled;
+
+	scaled.left = (int)((rect.left < 0 ? 0 : rect.left) * picScaleX);
+	scaled.top = (int)((rect.top < 0 ? 0 : rect.top) * picScaleY);
+	scaled.right = (int)ceil((rect.right > 160 ? 160 : rect.right) * picScaleX);
+	scaled.bottom = (int)ceil((rect.bottom > 168 ? 168 : rect.bottom) * picScaleY);
+	if (scaled.right > (int)picture->width) scaled.right = picture->width;
+	if (scaled.bottom > (int)picture->height) scaled.bottom = picture->height;
+	if (scaled.right < scaled.left) scaled.right = scaled.left;
+	if (scaled.bottom < scaled.top) scaled.bottom = scaled.top;
+
+	return scaled;
+}
+
+/**************************************************************************
+** fillBounds
+**
+** Bounding rectangle of the pixels set by the current fill command.
+**************************************************************************/
+Rect PicDrawer::fillBounds()
+{
+	Rect bounds = { 0, 0, 0, 0 };
+
+	for (int y = fillRowMin; y <= fillRowMax; y++)
+	{
+		const uint64_t* row = lastFill + y * fillStride;
+
+		for (unsigned n = 0; n < fillStride; n++)
+		{
+			if (row[n])
+			{
+				addPoint(bounds, n * 64 + lowestBit(row[n]), y);
+				addPoint(bounds, n * 64 + highestBit(row[n]), y);
+			}
+		}
+	}
+
+	return bounds;
+}
+
+/**************************************************************************
+** runCommand
+**
+** Runs the next command through the handler table, picking the handlers
+** for the planes that are currently enabled.
+**************************************************************************/
+inline bool PicDrawer::runCommand()
+{
+	uint8_t action = *(pictureDataPtr++);
+
+	commandCount++;
+	if (action < 0xF0)
+	{
+		unknownCommand(&pictureDataPtr);
+	}
+	else
+	{
+		(this->*commands[drawPlanes()][action & 0x0F])(&pictureDataPtr);
+	}
+
+	if (pictureDataPtr >= (pictureData + pictureDataLength))
+	{
+		isDrawing = false;
+	}
+
+	if (checkpointInterval && !regionOnly && commandCount == checkpoints.size() * checkpointInterval)
+	{
+		takeCheckpoint();
+	}
+
+	return isDrawing;
+}
+
+void PicDrawer::setPictureColour(const byte** data)
+{
+	picColour = *((*data)++);
+	picDrawEnabled = true;
+}
+
+void PicDrawer::disablePicture(const byte**)
+{
+	picDrawEnabled = false;
+}
+
+void PicDrawer::setPriorityColour(const byte** data)
+{
+	priColour = *((*data)++);
+	priDrawEnabled = true;
+}
+
+void PicDrawer::disablePriority(const byte**)
+{
+	priDrawEnabled = false;
+}
+
+void PicDrawer::setPattern(const byte** data)
+{
+	patCode = *((*data)++);
+}
+
+void PicDrawer::endDrawing(const byte**)
+{
+	isDrawing = false;
+}
+
+void PicDrawer::unknownCommand(const byte** data)
+{
+	printf("Unknown picture code : %X width: %d, height: %d\n", (*data)[-1], picture->width, picture->height);
+	isDrawing = false;
+}
+
+/**************************************************************************
+** skipLine / skipFill / skipArguments
+**
+** Step over the arguments of a drawing command that can't draw anything
+** because both planes are disabled. The line commands always read their
+** first coordinate pair, and every command then runs up to the next
+** command byte. A fill still ends the previous fill.
+**************************************************************************/
+void PicDrawer::skipLine(const byte** data)
+{
+	*data += 2;
+	skipArguments(data);
+}
+
+void PicDrawer::skipFill(const byte** data)
+{
+	clearFills();
+	fillFrontier.clear();
+	skipArguments(data);
+}
+
+void PicDrawer::skipArguments(const byte** data)
+{
+	while (**data < 0xF0)
+	{
+		(*data)++;
+	}
+}
+
+#define COMMAND_TABLE_ROW(line1, line2, line3, line4, fill, brush) \
+	{ &PicDrawer::setPictureColour, &PicDrawer::disablePicture, \
+	  &PicDrawer::setPriorityColour, &PicDrawer::disablePriority, \
+	  &PicDrawer::line1, &PicDrawer::line2, &PicDrawer::line3, &PicDrawer::line4, \
+	  &PicDrawer::fill, &PicDrawer::setPattern, &PicDrawer::brush, \
+	  &PicDrawer::unknownCommand, &PicDrawer::unknownCommand, \
+	  &PicDrawer::unknownCommand, &PicDrawer::unknownCommand, \
+	  &PicDrawer::endDrawing }
+
+const PicDrawer::Command PicDrawer::commands[4][16] =
+{
+	COMMAND_TABLE_ROW(skipLine, skipLine, skipLine, skipLine, skipFill, skipArguments),
+	COMMAND_TABLE_ROW(yCorner<PLANES_PICTURE>, xCorner<PLANES_PICTURE>,
+		absoluteLine<PLANES_PICTURE>, relativeDraw<PLANES_PICTURE>,
+		fill<PLANES_PICTURE>, plotBrush<PLANES_PICTURE>),
+	COMMAND_TABLE_ROW(yCorner<PLANES_PRIORITY>, xCorner<PLANES_PRIORITY>,
+		absoluteLine<PLANES_PRIORITY>, relativeDraw<PLANES_PRIORITY>,
+		fill<PLANES_PRIORITY>, plotBrush<PLANES_PRIORITY>),
+	COMMAND_TABLE_ROW(yCorner<PLANES_BOTH>, xCorner<PLANES_BOTH>,
+		absoluteLine<PLANES_BOTH>, relativeDraw<PLANES_BOTH>,
+		fill<PLANES_BOTH>, plotBrush<PLANES_BOTH>)
+};
+
+/**************************************************************************
+** replaceWhite
+**
+** Copies each white pixel of row from replacement, leaving every other
+** pixel as it is. Works 32 or 16 pixels at a time where possible. Returns
+** the span of pixels that changed colour, which is empty if none did.
+**************************************************************************/
+static void addChanges(Span& changed, unsigned int x, uint64_t changes)
+{
+	if (!changes) return;
+	if (changed.start >= changed.end) changed.start = x + lowestBit(changes);
+	changed.end = x + highestBit(changes) + 1;
+}
+
+static Span replaceWhite(uint8_t* row, const uint8_t* replacement, unsigned int width)
+{
+	Span changed = { 0, 0 };
+	unsigned int x = 0;
+
+#if defined(__AVX2__)
+	const __m256i white32 = _mm256_set1_epi8(15);
+	for (; x + 32 <= width; x += 32)
+	{
+		__m256i pixels = _mm256_loadu_si256((const __m256i*)(row + x));
+		__m256i colours = _mm256_loadu_si256((const __m256i*)(replacement + x));
+		__m256i isWhite = _mm256_cmpeq_epi8(pixels, white32);
+		_mm256_storeu_si256((__m256i*)(row + x), _mm256_blendv_epi8(pixels, colours, isWhite));
+		addChanges(changed, x, (uint32_t)_mm256_movemask_epi8(_mm256_andnot_si256(_mm256_cmpeq_epi8(colours, white32), isWhite)));
+	}
+#endif
+#if defined(USE_SSE2)
+	const __m128i white16 = _mm_set1_epi8(15);
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+		__m128i colours = _mm_loadu_si128((const __m128i*)(replacement + x));
+		__m128i isWhite = _mm_cmpeq_epi8(pixels, white16);
+		_mm_storeu_si128((__m128i*)(row + x), _mm_or_si128(_mm_and_si128(isWhite, colours), _mm_andnot_si128(isWhite, pixels)));
+		addChanges(changed, x, (uint32_t)_mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(colours, white16), isWhite)));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		if (row[x] == 15)
+		{
+			row[x] = replacement[x];
+			addChanges(changed, x, row[x] != 15);
+		}
+	}
+
+	return changed;
+}
+
+/**************************************************************************
+** replaceWhiteRuns
+**
+** The run length version of replaceWhite. White runs of row are split
+** along the runs of replacement, every other run is kept as it is.
+**************************************************************************/
+static Span replaceWhiteRuns(std::vector<Run>& row, const std::vector<Run>& replacement, std::vector<Run>& scratch)
+{
+	Span changed = { 0, 0 };
+	unsigned int start = 0;
+	size_t r = 0;
+
+	scratch.clear();
+	for (size_t n = 0; n < row.size(); n++)
+	{
+		if (row[n].colour != 15)
+		{
+			appendRun(scratch, row[n].end, row[n].colour);
+		}
+		else
+		{
+			while (start < row[n].end)
+			{
+				while (replacement[r].end <= start) r++;
+				unsigned int end = replacement[r].end < row[n].end ? replacement[r].end : row[n].end;
+				appendRun(scratch, end, replacement[r].colour);
+				if (replacement[r].colour != 15)
+				{
+					if (changed.start >= changed.end) changed.start = start;
+					changed.end = end;
+				}
+				start = end;
+			}
+		}
+		start = row[n].end;
+	}
+
+	// Copied rather than swapped, so each row keeps the memory it has
+	row.assign(scratch.begin(), scratch.end());
+	return changed;
+}
+
+/**************************************************************************
+** fillGaps
+**
+** Fills white pixels left over by the upscaled fills with the colour of
+** the reference picture, unless the reference is white there or beside
+** it. The replacement colours only depend on the reference row, so they
+** are gathered once for each run of rows that map to the same one. Run
+** length encoded pictures are updated a run at a time.
+**************************************************************************/
+void PicDrawer::fillGaps()
+{
+	Bitmap* reference = referenceDrawer->picture;
+	int refWidth = refX[picture->width - 1] + 1;
+
+	std::vector<uint8_t>& refColours = gapColours;
+	std::vector<uint8_t>& replacement = gapReplacement;
+	std::vector<Run>& replacementRuns = gapRuns;
+	std::vector<Run>& scratchRuns = gapScratchRuns;
+	int gatheredRow = -1;
+
+	refColours.resize(refWidth);
+	replacement.resize(picture->width);
+
+	dirty = Rect();
+	for (unsigned int y = 0; y < picture->height; y++)
+	{
+		int scaledY = refY[y];
+
+		if (scaledY != gatheredRow)
+		{
+			for (int i = 0; i < refWidth; i++)
+			{
+				uint8_t left = reference->Get(i - 1, scaledY);
+				uint8_t centre = reference->Get(i, scaledY);
+				uint8_t right = reference->Get(i + 1, scaledY);
+				refColours[i] = (left == 15 || centre == 15 || right == 15) ? 15 : centre;
+			}
+			for (unsigned int x = 0; x < picture->width; x++)
+			{
+				replacement[x] = refColours[refX[x]];
+			}
+			if (!picture->data)
+			{
+				replacementRuns.clear();
+				for (unsigned int x = 0; x < picture->width; x++)
+				{
+					appendRun(replacementRuns, x + 1, replacement[x]);
+				}
+			}
+			gatheredRow = scaledY;
+		}
+
+		Span changed;
+		if (picture->data)
+		{
+			changed = replaceWhite(picture->data + y * picture->width, replacement.data(), picture->width);
+		}
+		else
+		{
+			changed = replaceWhiteRuns(picture->rows[y], replacementRuns, scratchRuns);
+		}
+
+		if (changed.start < changed.end)
+		{
+			markDirty(changed.start, y, changed.end, y + 1);
+		}
+	}
+}
+
+/**************************************************************************
+** configureDrawers
+**
+** Applies the command line options to a base and upscaled drawer pair.
+**************************************************************************/
+void configureDrawers(PicDrawer& baseDrawer, PicDrawer& upscaleDrawer)
+{
+	baseDrawer.setFillEngine(options.fillEngine);
+	baseDrawer.setVerifyFills(options.verifyFills);
+	upscaleDrawer.setReferenceDrawer(&baseDrawer);
+	upscaleDrawer.setFillIterations(options.fillIterations);
+}
+
+/**************************************************************************
+** DrawerPool
+**
+** Keeps configured pairs of base and upscaled drawers for reuse. A pair
+** is reset when it is taken again, so once the buffers have grown to fit
+** the pictures, drawing allocates nothing. Pairs are matched by upscaled
+** size, and only the MAX_IDLE_DRAWERS most recently used are kept, so
+** -serve asked for many sizes doesn't hold on to a pair for each. A pool
+** isn't thread safe, so each worker needs its own.
+**************************************************************************/
+struct DrawerPair
+{
+	DrawerPair(unsigned int width, unsigned int height) : baseDrawer(BASE_WIDTH, BASE_HEIGHT),
+		upscaleDrawer(width, height, options.runLength, options.priorityOutput != PRIORITY_NONE)
+	{
+		configureDrawers(baseDrawer, upscaleDrawer);
+	}
+
+	PicDrawer baseDrawer;
+	PicDrawer upscaleDrawer;
+};
+
+class DrawerPool
+{
+public:
+	DrawerPair* acquire(unsigned int width = UPSCALED_WIDTH, unsigned int height = UPSCALED_HEIGHT);
+	void release(DrawerPair* pair);
+
+private:
+	std::vector<std::unique_ptr<DrawerPair> > idle;
+};
+
+DrawerPool drawerPool;
+
+DrawerPair* DrawerPool::acquire(unsigned int width, unsigned int height)
+{
+	for (size_t n = idle.size(); n-- > 0;)
+	{
+		Bitmap* picture = idle[n]->upscaleDrawer.getPicture();
+
+		if (picture->width == width && picture->height == height)
+		{
+			DrawerPair* pair = idle[n].release();
+			idle.erase(idle.begin() + n);
+			pair->baseDrawer.reset();
+			pair->upscaleDrawer.reset();
+			return pair;
+		}
+	}
+	return new DrawerPair(width, height);
+}
+
+// Idle pairs are kept in the order they were released, so the least
+// recently used is dropped first
+void DrawerPool::release(DrawerPair* pair)
+{
+	idle.push_back(std::unique_ptr<DrawerPair>(pair));
+	if (idle.size() > MAX_IDLE_DRAWERS)
+	{
+		idle.erase(idle.begin());
+	}
+}
+
+/**************************************************************************
+** drawPicture
+**
+** Draws the rest of the picture on a pair of drawers and fills the gaps.
+** With -apng the drawers are stepped together instead, and the drawing
+** is saved to animationPath with a frame every animationInterval commands
+** that changed something, plus one for fillGaps.
+**************************************************************************/
+void drawPicture(PicDrawer& baseDrawer, PicDrawer& upscaleDrawer, const char* animationPath)
+{
+	if (!options.animationInterval)
+	{
+		upscaleDrawer.drawAll();
+		upscaleDrawer.fillGaps();
+		return;
+	}
+
+	Rect changed = { 0, 0, 0, 0 };
+
+	apngWriter.begin(upscaleDrawer.getPicture());
+	while (baseDrawer.drawStep())
+	{
+		upscaleDrawer.drawStep();
+		unionRect(changed, upscaleDrawer.getDirtyRect());
+
+		if (baseDrawer.getCommandCount() % options.animationInterval == 0 && !changed.empty())
+		{
+			apngWriter.addFrame(upscaleDrawer.getPicture(), changed);
+			changed = Rect();
+		}
+	}
+
+	upscaleDrawer.fillGaps();
+	unionRect(changed, upscaleDrawer.getDirtyRect());
+	if (!changed.empty())
+	{
+		apngWriter.addFrame(upscaleDrawer.getPicture(), changed);
+	}
+
+	apngWriter.save(animationPath);
+}
+
+/**************************************************************************
+** benchmarkDrawing
+**
+** Draws a picture once stepping both drawers command by command, then
+** again with drawAll, and adds the times to drawStats.
+**************************************************************************/
+void benchmarkDrawing(const uint8_t* data, long length)
+{
+	clock_t start = clock();
+	{
+		PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+		PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, options.runLength, false);
+		configureDrawers(baseDrawer, upscaleDrawer);
+		baseDrawer.beginDrawing(data, length);
+		upscaleDrawer.beginDrawing(data, length);
+		while (baseDrawer.drawStep())
+		{
+			upscaleDrawer.drawStep();
+		}
+		drawStats.commands += baseDrawer.getCommandCount();
+	}
+	drawStats.stepTime += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	{
+		PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+		PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, options.runLength, false);
+		configureDrawers(baseDrawer, upscaleDrawer);
+		baseDrawer.beginDrawing(data, length);
+		upscaleDrawer.beginDrawing(data, length);
+		upscaleDrawer.drawAll();
+	}
+	drawStats.drawAllTime += (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/**************************************************************************
+** verifySeeking
+**
+** Draws a picture with checkpoints, then seeks back through it and forward
+** again, checking every plane after each seek against a pair of drawers
+** that stepped through the same number of commands from the start. Adds
+** the results to seekStats.
+**************************************************************************/
+static void copyPlanes(PicDrawer& baseDrawer, PicDrawer& upscaleDrawer, std::vector<uint8_t> planes[4])
+{
+	baseDrawer.getPicture()->CopyTo(planes[0]);
+	baseDrawer.getPriority()->CopyTo(planes[1]);
+	upscaleDrawer.getPicture()->CopyTo(planes[2]);
+	upscaleDrawer.getPriority()->CopyTo(planes[3]);
+}
+
+static void drawToCommand(const uint8_t* data, long length, unsigned int index, std::vector<uint8_t> planes[4])
+{
+	PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+	PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, options.runLength, true);
+	configureDrawers(baseDrawer, upscaleDrawer);
+	baseDrawer.beginDrawing(data, length);
+	upscaleDrawer.beginDrawing(data, length);
+	while (baseDrawer.getCommandCount() < index && baseDrawer.drawStep())
+	{
+		upscaleDrawer.drawStep();
+	}
+	copyPlanes(baseDrawer, upscaleDrawer, planes);
+}
+
+void verifySeeking(const char* name, const uint8_t* data, long length)
+{
+	PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+	PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, options.runLength, true);
+	configureDrawers(baseDrawer, upscaleDrawer);
+	upscaleDrawer.enableCheckpoints(VERIFY_CHECKPOINT_INTERVAL);
+	baseDrawer.beginDrawing(data, length);
+	upscaleDrawer.beginDrawing(data, length);
+	upscaleDrawer.drawAll();
+
+	// Down by eighths from the end, then up by the sixteenths in between
+	// and back to the end
+	unsigned int commands = baseDrawer.getCommandCount();
+	unsigned int indices[18];
+	for (int n = 0; n <= 8; n++)
+	{
+		indices[n] = commands * (8 - n) / 8;
+	}
+	for (int n = 1; n <= 8; n++)
+	{
+		indices[8 + n] = commands * (2 * n - 1) / 16;
+	}
+	indices[17] = commands;
+
+	for (int n = 0; n < 18; n++)
+	{
+		std::vector<uint8_t> seeked[4], drawn[4];
+		bool found = upscaleDrawer.seekToCommand(indices[n]);
+
+		copyPlanes(baseDrawer, upscaleDrawer, seeked);
+		drawToCommand(data, length, indices[n], drawn);
+		seekStats.verified++;
+		for (int plane = 0; plane < 4; plane++)
+		{
+			if (!found || seeked[plane] != drawn[plane])
+			{
+				seekStats.mismatched++;
+				printf("%s: seeking to command %u doesn't match drawing to it\n", name, indices[n]);
+				break;
+			}
+		}
+	}
+}
+
+/**************************************************************************
+** verifyEditing
+**
+** Draws a picture with checkpoints, then edits commands spread through it
+** one after another. After each edit the drawers are brought up to date
+** with redrawEdited and fillGaps, and every plane is checked against a
+** pair of drawers that drew the edited picture from the start. Adds the
+** results to editStats.
+**************************************************************************/
+void verifyEditing(const char* name, const uint8_t* data, unsigned length)
+{
+	PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+	PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, options.runLength, true);
+	configureDrawers(baseDrawer, upscaleDrawer);
+	upscaleDrawer.enableCheckpoints(VERIFY_CHECKPOINT_INTERVAL);
+	baseDrawer.beginDrawing(data, length);
+	upscaleDrawer.beginDrawing(data, length);
+	upscaleDrawer.drawAll();
+	upscaleDrawer.fillGaps();
+
+	// The drawers keep reading the last picture they were given, so the
+	// edits take turns between two copies
+	std::vector<uint8_t> copies[2];
+	const uint8_t* current = data;
+	int next = 0;
+	unsigned int commands = baseDrawer.getCommandCount();
+
+	for (int n = 0; n < 8; n++)
+	{
+		unsigned int index = commands * n / 8;
+		std::vector<uint8_t>& edited = copies[next];
+		uint8_t patCode;
+		unsigned problemOffset;
+
+		// Flipping the low bit of the first argument moves a coordinate
+		// by a pixel, or changes a colour or pattern
+		edited.assign(current, current + length);
+		unsigned pos = commandOffset(edited.data(), length, index, patCode);
+		if (pos >= length || nextCommand(edited.data(), length, pos) < pos + 2)
+		{
+			continue;
+		}
+		edited[pos + 1] ^= 1;
+		if (validatePicture(edited.data(), length, problemOffset))
+		{
+			continue;
+		}
+
+		RedrawResult result = upscaleDrawer.redrawEdited(index, edited.data(), length);
+		if (result != REDRAW_FAILED)
+		{
+			current = edited.data();
+			next ^= 1;
+		}
+		upscaleDrawer.fillGaps();
+
+		std::vector<uint8_t> redrawn[4], drawn[4];
+		copyPlanes(baseDrawer, upscaleDrawer, redrawn);
+		{
+			PicDrawer freshBase(BASE_WIDTH, BASE_HEIGHT);
+			PicDrawer freshUpscale(UPSCALED_WIDTH, UPSCALED_HEIGHT, options.runLength, true);
+			configureDrawers(freshBase, freshUpscale);
+			freshBase.beginDrawing(edited.data(), length);
+			freshUpscale.beginDrawing(edited.data(), length);
+			freshUpscale.drawAll();
+			freshUpscale.fillGaps();
+			copyPlanes(freshBase, freshUpscale, drawn);
+		}
+
+		editStats.verified++;
+		if (result == REDRAW_REGION)
+		{
+			editStats.regions++;
+		}
+		for (int plane = 0; plane < 4; plane++)
+		{
+			if (result == REDRAW_FAILED || redrawn[plane] != drawn[plane])
+			{
+				editStats.mismatched++;
+				printf("%s: redrawing after editing command %u doesn't match drawing it again\n", name, index);
+				break;
+			}
+		}
+	}
+}
+
+/**************************************************************************
+** selfTest
+**
+** Draws pictures that once broke the drawers, with each fill engine and
+** canvas, and checks they come out the same as versions without the
+** commands that should do nothing. Builds with AGI_ALLOC_STATS also check
+** that drawing allocates nothing once the drawers are made. Used by
+** -selftest, which exits with a failure status if any check fails.
+**************************************************************************/
+struct RegressionPicture
+{
+	const char* name;
+	const uint8_t* data;
+	unsigned length;
+	const uint8_t* expected;
+	unsigned expectedLength;
+};
+
+// A fill of the priority screen in the colour it starts in never finished
+static const uint8_t endlessPriorityFill[] = { 0xF2, 0x04, 0xF8, 0x10, 0x10, 0xFF };
+static const uint8_t endlessPriorityFillDrawn[] = { 0xF2, 0x04, 0xFF };
+static const uint8_t whiteFill[] = { 0xF0, 0x0F, 0xF8, 0x10, 0x10, 0xFF };
+static const uint8_t whiteFillDrawn[] = { 0xF0, 0x0F, 0xFF };
+
+static const RegressionPicture regressionPictures[] =
+{
+	{ "endless priority fill", endlessPriorityFill, sizeof(endlessPriorityFill), endlessPriorityFillDrawn, sizeof(endlessPriorityFillDrawn) },
+	{ "white fill", whiteFill, sizeof(whiteFill), whiteFillDrawn, sizeof(whiteFillDrawn) },
+};
+
+static void drawForTest(const uint8_t* data, unsigned length, FillEngine engine, bool runLength, std::vector<uint8_t> planes[4])
+{
+	PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+	PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, runLength, true);
+
+	baseDrawer.setFillEngine(engine);
+	upscaleDrawer.setReferenceDrawer(&baseDrawer);
+	baseDrawer.beginDrawing(data, length);
+	upscaleDrawer.beginDrawing(data, length);
+	upscaleDrawer.drawAll();
+	upscaleDrawer.fillGaps();
+
+	copyPlanes(baseDrawer, upscaleDrawer, planes);
+}
+
+#if defined(AGI_ALLOC_STATS)
+// Lines, fills and splatter plots, to give the drawers' buffers some work
+static const uint8_t busyPicture[] =
+{
+	0xF0, 0x02, 0xF2, 0x05,
+	0xF6, 0x00, 0x00, 0x9F, 0xA7, 0x9F, 0x00, 0x00, 0xA7, 0x50, 0x00, 0x50, 0xA7,
+	0xF0, 0x0C, 0xF8, 0x28, 0x10, 0x78, 0x90,
+	0xF9, 0x23, 0xFA, 0x40, 0x20, 0x30, 0x61, 0x50, 0x60,
+	0xF0, 0x09, 0xF7, 0x10, 0x30, 0x47, 0x3F, 0xC2, 0xF8, 0x14, 0x34,
+	0xFF
+};
+
+// Draws each picture with one pair of drawers, returning how many times
+// drawing allocated. The drawers size their buffers when they're made, so
+// this should be none.
+static unsigned long drawingAllocations(FillEngine engine, bool runLength)
+{
+	PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+	PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, runLength, true);
+
+	baseDrawer.setFillEngine(engine);
+	upscaleDrawer.setReferenceDrawer(&baseDrawer);
+
+	unsigned long allocations = allocationCount;
+	for (size_t n = 0; n <= sizeof(regressionPictures) / sizeof(regressionPictures[0]); n++)
+	{
+		const uint8_t* data = busyPicture;
+		unsigned length = sizeof(busyPicture);
+		if (n < sizeof(regressionPictures) / sizeof(regressionPictures[0]))
+		{
+			data = regressionPictures[n].data;
+			length = regressionPictures[n].length;
+		}
+		baseDrawer.beginDrawing(data, length);
+		upscaleDrawer.beginDrawing(data, length);
+		upscaleDrawer.drawAll();
+		upscaleDrawer.fillGaps();
+	}
+	return allocationCount - allocations;
+}
+#endif
+
+void selfTest()
+{
+	unsigned int failures = 0;
+
+	for (size_t n = 0; n < sizeof(regressionPictures) / sizeof(regressionPictures[0]); n++)
+	{
+		const RegressionPicture& test = regressionPictures[n];
+		unsigned offset;
+
+		if (validatePicture(test.data, test.length, offset))
+		{
+			printf("%s: doesn't validate\n", test.name);
+			failures++;
+			continue;
+		}
+
+		for (int variant = 0; variant < 4; variant++)
+		{
+			FillEngine engine = (variant & 1) ? FILL_BITWISE : FILL_QUEUE;
+			bool runLength = (variant & 2) != 0;
+			std::vector<uint8_t> drawn[4], expected[4];
+
+			drawForTest(test.data, test.length, engine, runLength, drawn);
+			drawForTest(test.expected, test.expectedLength, engine, runLength, expected);
+			for (int plane = 0; plane < 4; plane++)
+			{
+				if (drawn[plane] != expected[plane])
+				{
+					printf("%s: plane %d differs with the %s fill%s\n", test.name, plane,
+						engine == FILL_BITWISE ? "bitwise" : "queue", runLength ? " and -rle" : "");
+					failures++;
+					break;
+				}
+			}
+		}
+	}
+
+#if defined(AGI_ALLOC_STATS)
+	for (int variant = 0; variant < 4; variant++)
+	{
+		FillEngine engine = (variant & 1) ? FILL_BITWISE : FILL_QUEUE;
+		bool runLength = (variant & 2) != 0;
+		unsigned long allocations = drawingAllocations(engine, runLength);
+
+		if (allocations)
+		{
+			printf("Drawing with the %s fill%s allocated %lu times\n",
+				engine == FILL_BITWISE ? "bitwise" : "queue", runLength ? " and -rle" : "", allocations);
+			failures++;
+		}
+	}
+#endif
+
+	if (failures)
+	{
+		printf("Self test failed : %u problems\n", failures);
+		exit(1);
+	}
+	printf("Self test passed\n");
+}
+
+void printDrawStats()
+{
+	if (options.bench && drawStats.stepTime > 0 && drawStats.drawAllTime > 0)
+	{
+		printf("%lu commands, drawStep %.0f commands/s, drawAll %.0f commands/s\n", drawStats.commands,
+			drawStats.commands / drawStats.stepTime, drawStats.commands / drawStats.drawAllTime);
+	}
+}
+
+void printAllocStats()
+{
+	if (options.allocStats && allocStats.pictures)
+	{
+		printf("%u pictures, %lu heap allocations while drawing, %lu after the first picture\n",
+			allocStats.pictures, allocStats.drawing, allocStats.afterFirst);
+	}
+}
+
+void printFillStats()
+{
+	if (options.verifyFills)
+	{
+		printf("Verified %u fills, %u mismatched\n", fillStats.verified, fillStats.mismatched);
+	}
+}
+
+void printSeekStats()
+{
+	if (options.verifySeek)
+	{
+		printf("Verified %u seeks, %u mismatched\n", seekStats.verified, seekStats.mismatched);
+	}
+}
+
+void printEditStats()
+{
+	if (options.verifyEdit)
+	{
+		printf("Verified %u edits, %u redrawn in place, %u mismatched\n",
+			editStats.verified, editStats.regions, editStats.mismatched);
+	}
+}
+
+/**************************************************************************
+** RenderCache
+**
+** Keeps the images saved in ALL mode in the -cache directory, so pictures
+** that haven't changed since an earlier run are copied from there instead
+** of being drawn again. Entries are named after a hash of the picture
+** resource and of the settings that change the saved files: the upscaled
+** size, -iterations, the PNG encoder and -priority. The fill engine and
+** -rle only change how a picture is drawn, not the result.
+**************************************************************************/
+class RenderCache
+{
+public:
+	void open(const char* inDirectory);
+	void setPicture(const uint8_t* data, unsigned length);
+	bool fetch(const char* part, const char* path);
+	void store(const char* path, const char* part);
+
+	unsigned int hits = 0, misses = 0;
+
+private:
+	void entryPath(char* path, size_t size, const char* part, const char* suffix);
+
+	const char* directory;
+	char key[32];
+};
+
+RenderCache renderCache;
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t length)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+
+	for (size_t n = 0; n < length; n++)
+	{
+		hash = (hash ^ bytes[n]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static bool writeFile(const char* path, const uint8_t* data, unsigned length)
+{
+	FILE* file = fopen(path, "wb");
+
+	if (!file)
+	{
+		return false;
+	}
+	bool written = fwrite(data, 1, length, file) == length;
+	return !fclose(file) && written;
+}
+
+void RenderCache::open(const char* inDirectory)
+{
+	directory = inDirectory;
+#if defined(_WIN32)
+	CreateDirectoryA(directory, NULL);
+#else
+	mkdir(directory, 0777);
+#endif
+}
+
+void RenderCache::setPicture(const uint8_t* data, unsigned length)
+{
+	int settings[] = { RENDER_VERSION, UPSCALED_WIDTH, UPSCALED_HEIGHT, options.fillIterations, options.pngEncoder, options.priorityOutput };
+
+	uint64_t hash = hashBytes(14695981039346656037ull, settings, sizeof(settings));
+	hash = hashBytes(hash, data, length);
+	sprintf(key, "%016llx-%u", (unsigned long long)hash, length);
+}
+
+void RenderCache::entryPath(char* path, size_t size, const char* part, const char* suffix)
+{
+	snprintf(path, size, "%s/%s.%s%s", directory, key, part, suffix);
+}
+
+// Copies part of the current picture's entry to path, if it's there
+bool RenderCache::fetch(const char* part, const char* path)
+{
+	char entry[1024];
+	MappedFile file;
+
+	entryPath(entry, sizeof(entry), part, "");
+	return file.map(entry) && writeFile(path, file.data, file.length);
+}
+
+// Adds the file at path to the current picture's entry. It's written
+// under a name unique to this process first, so runs sharing the cache
+// never see half of it or write over each other's.
+void RenderCache::store(const char* path, const char* part)
+{
+	char entry[1024], temporary[1024], suffix[32];
+	MappedFile file;
+
+#if defined(_WIN32)
+	sprintf(suffix, ".%lu.tmp", (unsigned long)GetCurrentProcessId());
+#else
+	sprintf(suffix, ".%lu.tmp", (unsigned long)getpid());
+#endif
+	entryPath(entry, sizeof(entry), part, "");
+	entryPath(temporary, sizeof(temporary), part, suffix);
+	if (!file.map(path) || !writeFile(temporary, file.data, file.length))
+	{
+		printf("Error writing cache file : %s\n", temporary);
+		return;
+	}
+	file.unmap();
+
+	// rename replaces an existing entry in one step, except on Windows
+#if defined(_WIN32)
+	remove(entry);
+#endif
+	if (rename(temporary, entry))
+	{
+		remove(temporary);
+	}
+}
+
+/**************************************************************************
+** describeRender
+**
+** Writes the provenance saved in each PNG: a hash of the picture resource,
+** the size of the image, and the settings that change the images.
+**************************************************************************/
+void describeRender(const uint8_t* data, unsigned length, int width, int height, char* text, size_t size)
+{
+	uint64_t hash = hashBytes(14695981039346656037ull, data, length);
+
+	snprintf(text, size, "picture %016llx-%u, %dx%d, iterations %d, png %s, version %d",
+		(unsigned long long)hash, length, width, height, options.fillIterations,
+		options.pngEncoder == PNG_RUNS ? "runs" : "lodepng", RENDER_VERSION);
+}
+
+/**************************************************************************
+** hasProvenance
+**
+** Checks whether the PNG at path was saved with the given provenance. Only
+** the chunks before the image data are read, and nothing is decoded.
+**************************************************************************/
+bool hasProvenance(const char* path, const char* provenance)
+{
+	MappedFile file;
+	LodePNGState state;
+	unsigned width, height;
+	bool found = false;
+
+	if (!file.map(path))
+	{
+		return false;
+	}
+
+	lodepng_state_init(&state);
+	if (!lodepng_inspect(&width, &height, &state, file.data, file.length))
+	{
+		const uint8_t* end = file.data + file.length;
+
+		for (const uint8_t* chunk = file.data + 33; chunk + 12 <= end && !lodepng_chunk_type_equals(chunk, "IDAT");
+			chunk = lodepng_chunk_next_const(chunk, end))
+		{
+			if (lodepng_chunk_type_equals(chunk, "tEXt")
+				&& lodepng_inspect_chunk(&state, chunk - file.data, file.data, file.length))
+			{
+				break;
+			}
+		}
 
-	for(unsigned int y = 0; y < pic->height; y++)
-	{
-		for(unsigned int x = 0; x < pic->width; x++)
+		for (size_t n = 0; n < state.info_png.text_num; n++)
 		{
-			int index = pic->data[y * pic->width + x];
-			data.push_back(EGAPalette[index * 3]);
-			data.push_back(EGAPalette[index * 3 + 1]);
-			data.push_back(EGAPalette[index * 3 + 2]);
-			data.push_back(0xff);
+			if (!strcmp(state.info_png.text_keys[n], PROVENANCE_KEYWORD) && !strcmp(state.info_png.text_strings[n], provenance))
+			{
+				found = true;
+			}
 		}
 	}
-	
-	lodepng::encode(path, data, pic->width, pic->height);
+	lodepng_state_cleanup(&state);
+	return found;
 }
 
-uint8_t PicDrawer::getReferencePicture(word x, word y)
+unsigned int unchangedPictures;
+
+void printCacheStats()
 {
-	return referenceDrawer->picture->Get((word)(x / picScaleX), (word)(y / picScaleY));
+	if (options.cacheDirectory)
+	{
+		printf("Cache: %u hits, %u misses\n", renderCache.hits, renderCache.misses);
+	}
 }
 
-uint8_t PicDrawer::getReferencePriority(word x, word y)
+void printSkipStats()
 {
-	return referenceDrawer->priority->Get((word)(x / picScaleX), (word)(y / picScaleY));
+	if (options.skipUnchanged)
+	{
+		printf("%u pictures unchanged\n", unchangedPictures);
+	}
 }
 
-PicDrawer::PicDrawer(unsigned int width, unsigned int height)
+/**************************************************************************
+** processPicture
+**
+** Draws picture number in ALL mode and saves the results, with name used
+** for the picture in messages.
+**************************************************************************/
+void processPicture(int number, const char* name, const uint8_t* data, unsigned length)
 {
-	picScaleX = (float)width / 160.0f;
-	picScaleY = (float)height / 168.0f;
+	char filename[20];
+
+	unsigned offset;
+	const char* problem = validatePicture(data, length, offset);
+	if (problem)
+	{
+		printf("Skipping %s : %s at offset %u\n", name, problem, offset);
+		return;
+	}
+
+	// The drawing animation isn't cached, and raw priority screens can't
+	// say how they were drawn, so those are always drawn again
+	char upscalePath[20], priorityPath[20], provenance[100];
+	const char* priorityPart = options.priorityOutput == PRIORITY_PNG ? "priority.png" : "priority.raw";
+	bool cached = options.cacheDirectory && !options.animationInterval;
+
+	sprintf(upscalePath, "upscale-%d.png", number);
+	sprintf(priorityPath, "priority-%d.%s", number, options.priorityOutput == PRIORITY_PNG ? "png" : "raw");
+	describeRender(data, length, UPSCALED_WIDTH, UPSCALED_HEIGHT, provenance, sizeof(provenance));
+	if (options.skipUnchanged && !options.animationInterval && options.priorityOutput != PRIORITY_RAW
+		&& hasProvenance(upscalePath, provenance)
+		&& (options.priorityOutput == PRIORITY_NONE || hasProvenance(priorityPath, provenance)))
+	{
+		unchangedPictures++;
+		return;
+	}
+
+	if (options.bench)
+	{
+		benchmarkDrawing(data, length);
+	}
+
+	if (options.verifySeek)
+	{
+		verifySeeking(name, data, length);
+	}
+
+	if (options.verifyEdit)
+	{
+		verifyEditing(name, data, length);
+	}
+
+	if (cached)
+	{
+		renderCache.setPicture(data, length);
+		if (renderCache.fetch("upscale.png", upscalePath)
+			&& (options.priorityOutput == PRIORITY_NONE || renderCache.fetch(priorityPart, priorityPath)))
+		{
+			renderCache.hits++;
+			return;
+		}
+		renderCache.misses++;
+	}
+
+	unsigned long allocations = allocationCount;
+	DrawerPair* drawers = drawerPool.acquire();
+
+	drawers->baseDrawer.beginDrawing(data, length);
+	drawers->upscaleDrawer.beginDrawing(data, length);
+
+	sprintf(filename, "drawing-%d.png", number);
+	drawPicture(drawers->baseDrawer, drawers->upscaleDrawer, filename);
+
+	allocations = allocationCount - allocations;
+	allocStats.drawing += allocations;
+	if (allocStats.pictures++)
+	{
+		allocStats.afterFirst += allocations;
+	}
+
+	DumpToPNG(drawers->upscaleDrawer.getPicture(), upscalePath, provenance);
+
+	if (options.priorityOutput != PRIORITY_NONE)
+	{
+		sprintf(filename, "priority-%d", number);
+		DumpPriority(drawers->upscaleDrawer.getPriority(), filename, provenance);
+	}
 
-	picture = new Bitmap(width, height, 15);
-	priority = new Bitmap(width, height, 4);
+	drawerPool.release(drawers);
 
-	lastFill = new byte[width * height];
+	if (cached)
+	{
+		renderCache.store(upscalePath, "upscale.png");
+		if (options.priorityOutput != PRIORITY_NONE)
+		{
+			renderCache.store(priorityPath, priorityPart);
+		}
+	}
 }
 
-PicDrawer::~PicDrawer()
+void processFile(int number)
 {
-	delete picture;
-	delete priority;
-	delete[] lastFill;
+	MappedFile pictureFile;
+	char filename[20];
+	sprintf(filename, "PICTURE.%d", number);
+	if(pictureFile.map(filename))
+	{
+		processPicture(number, filename, pictureFile.data, pictureFile.length);
+	}
 }
 
-bool PicDrawer::didFill(word x, word y)
+void processGamePicture(AGIGame& game, int number)
 {
-	if (x < 0 || y < 0 || x >= picture->width || y >= picture->height)
+	const uint8_t* data;
+	unsigned length;
+	char name[20];
+
+	sprintf(name, "picture %d", number);
+	if (!game.hasPicture(number))
 	{
-		return false;
+		return;
+	}
+
+	const char* problem = game.findPicture(number, data, length);
+	if (problem)
+	{
+		printf("Skipping %s : %s\n", name, problem);
+		return;
 	}
-	return lastFill[y * picture->width + x] != 0;
+	processPicture(number, name, data, length);
 }
 
-bool PicDrawer::didReferenceFill(word x, word y)
+/**************************************************************************
+** RenderServer
+**
+** Draws pictures on request for -serve, so a pipeline rendering many
+** pictures doesn't pay for starting a process, warming up the drawers and
+** touching the file system each time. It reads requests from stdin and
+** answers on stdout, or with a socket path accepts connections there one
+** at a time. The drawers, encoders and buffers are kept between requests.
+**
+** With stdio, stdout is kept for the answers and anything else printed
+** goes to stderr. All numbers are 32 bit little endian. A request is the upscaled width
+** and height (both 0 for the built in size), the output format (0 for a
+** PNG, 1 for one byte per pixel of raw EGA colours) and the length of
+** the picture resource, followed by the resource. The answer is a status
+** (0 for success, 1 for failure) and a length, followed by the image or
+** by a message saying what was wrong. A connection can send any number
+** of requests.
+**************************************************************************/
+enum ServeFormat
+{
+	SERVE_PNG,
+	SERVE_RAW
+};
+
+class RenderServer
+{
+public:
+	void serve(const char* address);
+
+private:
+	void serveConnection(FILE* in, FILE* out);
+	bool answer(FILE* out, uint32_t status, const void* data, size_t length);
+	const char* render(uint32_t width, uint32_t height, uint32_t format);
+
+	std::vector<uint8_t> request, image;
+	char message[100];
+};
+
+static bool readLittleWord(FILE* in, uint32_t& value)
 {
-	word scaledX = (word)(x / picScaleX);
-	word scaledY = (word)(y / picScaleY);
+	uint8_t bytes[4];
 
-	//return referenceDrawer->didFill(scaledX, scaledY);
-	
-	for (int j = -1; j <= 1; j++)
+	if (fread(bytes, 1, 4, in) != 4)
 	{
-		for (int i = -1; i <= 1; i++)
-		{
-			if (referenceDrawer->didFill(scaledX + i, scaledY + j))
-			{
-				return true;
-			}
-		}
+		return false;
 	}
-
-	return false;
+	value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+	return true;
 }
 
-void PicDrawer::beginDrawing(uint8_t* inData, unsigned length)
+static void writeLittleWord(FILE* out, uint32_t value)
 {
-	pictureDataPtr = pictureData = inData;
-	pictureDataLength = length;
-	isDrawing = true;
+	uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+	fwrite(bytes, 1, 4, out);
 }
 
-bool PicDrawer::drawStep()
+void RenderServer::serve(const char* address)
 {
-	if (!isDrawing)
+	if (!strcmp(address, "stdio"))
 	{
-		return false;
+		// Answer on a copy of stdout, and point stdout itself at stderr
+		// so messages such as -verifyfill's can't end up in an answer
+		fflush(stdout);
+#if defined(_WIN32)
+		int answers = _dup(_fileno(stdout));
+		_dup2(_fileno(stderr), _fileno(stdout));
+		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(answers, _O_BINARY);
+		FILE* out = _fdopen(answers, "wb");
+#else
+		int answers = dup(fileno(stdout));
+		dup2(fileno(stderr), fileno(stdout));
+		FILE* out = fdopen(answers, "wb");
+#endif
+		if (out)
+		{
+			serveConnection(stdin, out);
+			fclose(out);
+		}
+		return;
 	}
 
-	uint8_t action = *(pictureDataPtr++);
+#if defined(_WIN32)
+	printf("Only -serve stdio is supported on Windows\n");
+#else
+	sockaddr_un socketAddress;
+	struct stat status;
 
-	switch (action) {
-	case 0xFF: isDrawing = false; break;
-	case 0xF0: picColour = *(pictureDataPtr++);
-		picDrawEnabled = true;
-		break;
-	case 0xF1: picDrawEnabled = false; break;
-	case 0xF2: priColour = *(pictureDataPtr++);
-		priDrawEnabled = true;
-		break;
-	case 0xF3: priDrawEnabled = false; break;
-	case 0xF4: yCorner(&pictureDataPtr); break;
-	case 0xF5: xCorner(&pictureDataPtr); break;
-	case 0xF6: absoluteLine(&pictureDataPtr); break;
-	case 0xF7: relativeDraw(&pictureDataPtr); break;
-	case 0xF8: fill(&pictureDataPtr); break;
-	case 0xF9: patCode = *(pictureDataPtr++); break;
-	case 0xFA: plotBrush(&pictureDataPtr); break;
-	default: printf("Unknown picture code : %X width: %d, height: %d\n", action, picture->width, picture->height); exit(0);
+	if (strlen(address) >= sizeof(socketAddress.sun_path))
+	{
+		printf("Socket path is too long : %s\n", address);
+		return;
 	}
+	memset(&socketAddress, 0, sizeof(socketAddress));
+	socketAddress.sun_family = AF_UNIX;
+	strcpy(socketAddress.sun_path, address);
 
-	if (pictureDataPtr >= (pictureData + pictureDataLength))
+	// Clear away the socket left by an earlier server, but nothing else
+	if (!stat(address, &status) && S_ISSOCK(status.st_mode))
 	{
-		isDrawing = false;
+		unlink(address);
 	}
 
-	return isDrawing;
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (sockaddr*)&socketAddress, sizeof(socketAddress)) || listen(listener, 8))
+	{
+		printf("Error listening on socket : %s\n", address);
+		return;
+	}
+
+	// A client hanging up early shouldn't end the server
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;)
+	{
+		int connection = accept(listener, nullptr, nullptr);
+		if (connection < 0)
+		{
+			continue;
+		}
+
+		FILE* in = fdopen(connection, "rb");
+		FILE* out = fdopen(dup(connection), "wb");
+		if (in && out)
+		{
+			serveConnection(in, out);
+		}
+		if (in)
+		{
+			fclose(in);
+		}
+		if (out)
+		{
+			fclose(out);
+		}
+	}
+#endif
 }
 
-void PicDrawer::fillGaps()
+void RenderServer::serveConnection(FILE* in, FILE* out)
 {
-	for (int y = 0; y < picture->height; y++)
+	uint32_t width, height, format, length;
+
+	while (readLittleWord(in, width) && readLittleWord(in, height) && readLittleWord(in, format) && readLittleWord(in, length))
 	{
-		for (int x = 0; x < picture->width; x++)
+		// Resource lengths are 16 bits, so anything longer isn't a picture,
+		// and what follows can't be trusted to be the next request either
+		if (length > 0xFFFF)
 		{
-			if (picture->Get(x, y) == 15)
-			{
-				int scaledX = (int)(x / picScaleX);
-				int scaledY = (int)(y / picScaleY);
-				bool refHasWhite = false;
+			const char* problem = "picture is too long";
+			answer(out, 1, problem, strlen(problem));
+			return;
+		}
 
-				for (int i = -1; i <= 1; i++)
-				{
-					if (referenceDrawer->picture->Get(scaledX + i, scaledY) == 15)
-					{
-						refHasWhite = true;
-						break;
-					}
-				}
+		request.resize(length);
+		if (fread(request.data(), 1, length, in) != length)
+		{
+			return;
+		}
 
-				if (!refHasWhite)
-				{
-					picture->Set(x, y, referenceDrawer->picture->Get(scaledX, scaledY));
-				}
-			}
+		const char* problem = render(width, height, format);
+		bool sent = problem ? answer(out, 1, problem, strlen(problem)) : answer(out, 0, image.data(), image.size());
+		if (!sent)
+		{
+			return;
 		}
 	}
 }
 
-void processFile(int number)
+bool RenderServer::answer(FILE* out, uint32_t status, const void* data, size_t length)
 {
-	FILE* pictureFile;
-	char filename[20];
-	sprintf(filename, "PICTURE.%d", number);
-	pictureFile = fopen(filename, "rb");
-	if(!pictureFile)
+	writeLittleWord(out, status);
+	writeLittleWord(out, (uint32_t)length);
+	fwrite(data, 1, length, out);
+	return !fflush(out);
+}
+
+// Draws the requested picture into image, returning what went wrong if it
+// can't
+const char* RenderServer::render(uint32_t width, uint32_t height, uint32_t format)
+{
+	if (!width && !height)
 	{
-		return;
+		width = UPSCALED_WIDTH;
+		height = UPSCALED_HEIGHT;
+	}
+	if (width < BASE_WIDTH || height < BASE_HEIGHT || width > MAX_SERVE_SIZE || height > MAX_SERVE_SIZE)
+	{
+		return "unsupported size";
+	}
+	if (format != SERVE_PNG && format != SERVE_RAW)
+	{
+		return "unknown output format";
 	}
 
-	long fileLen = getLength(pictureFile);
-	uint8_t* dataFile = (byte *)malloc(fileLen + 20);
-	fread(dataFile, 1, fileLen, pictureFile);
-	fclose(pictureFile);
+	unsigned offset;
+	const char* problem = validatePicture(request.data(), (unsigned)request.size(), offset);
+	if (problem)
+	{
+		snprintf(message, sizeof(message), "%s at offset %u", problem, offset);
+		return message;
+	}
 
-	PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
-	PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT);
-	upscaleDrawer.setReferenceDrawer(&baseDrawer);
+	DrawerPair* drawers = drawerPool.acquire(width, height);
 
-	baseDrawer.beginDrawing(dataFile, fileLen);
-	upscaleDrawer.beginDrawing(dataFile, fileLen);
+	drawers->baseDrawer.beginDrawing(request.data(), (unsigned)request.size());
+	drawers->upscaleDrawer.beginDrawing(request.data(), (unsigned)request.size());
+	drawers->upscaleDrawer.drawAll();
+	drawers->upscaleDrawer.fillGaps();
 
-	while (baseDrawer.drawStep())
+	Bitmap* picture = drawers->upscaleDrawer.getPicture();
+	image.clear();
+	if (format == SERVE_PNG)
 	{
-	   upscaleDrawer.drawStep();
+		encodePNG(picture, image);
 	}
+	else
+	{
+		image.resize((size_t)width * height);
+		for (unsigned int y = 0; y < height; y++)
+		{
+			uint8_t* row = image.data() + (size_t)y * width;
+			const uint8_t* pixels = picture->GetRow(y, row);
 
-	upscaleDrawer.fillGaps();
-
-	sprintf(filename, "upscale-%d.png", number);
-	DumpToPNG(upscaleDrawer.getPicture(), filename);
+			if (pixels != row)
+			{
+				memcpy(row, pixels, width);
+			}
+		}
+	}
 
-	free(dataFile);
-	
+	drawerPool.release(drawers);
+	return NULL;
 }
 
 /**************************************************************************
@@ -859,50 +4877,269 @@ void processFile(int number)
 **************************************************************************/
 void main(int argc, char* argv[])
 {
-   FILE *pictureFile;
+   MappedFile pictureFile;
+   AGIGame game;
+   const uint8_t* pictureData;
+   unsigned pictureLength;
+   int argn = 1;
+
+   while (argn < argc && argv[argn][0] == '-')
+   {
+	   if (!strcmp(argv[argn], "-iterations") && argn + 1 < argc)
+	   {
+		   options.fillIterations = atoi(argv[argn + 1]);
+		   argn += 2;
+	   }
+	   else if (!strcmp(argv[argn], "-fill") && argn + 1 < argc)
+	   {
+		   if (!strcmp(argv[argn + 1], "queue"))
+		   {
+			   options.fillEngine = FILL_QUEUE;
+		   }
+		   else if (!strcmp(argv[argn + 1], "bitwise"))
+		   {
+			   options.fillEngine = FILL_BITWISE;
+		   }
+		   else
+		   {
+			   printf("Unknown fill engine : %s\n", argv[argn + 1]);
+			   exit(0);
+		   }
+		   argn += 2;
+	   }
+	   else if (!strcmp(argv[argn], "-verifyfill"))
+	   {
+		   options.verifyFills = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-rle"))
+	   {
+		   options.runLength = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-png") && argn + 1 < argc)
+	   {
+		   if (!strcmp(argv[argn + 1], "lodepng"))
+		   {
+			   options.pngEncoder = PNG_LODEPNG;
+		   }
+		   else if (!strcmp(argv[argn + 1], "runs"))
+		   {
+			   options.pngEncoder = PNG_RUNS;
+		   }
+		   else
+		   {
+			   printf("Unknown PNG encoder : %s\n", argv[argn + 1]);
+			   exit(0);
+		   }
+		   argn += 2;
+	   }
+	   else if (!strcmp(argv[argn], "-pngstats"))
+	   {
+		   options.pngStats = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-verifypng"))
+	   {
+		   options.verifyPNG = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-verifyseek"))
+	   {
+		   options.verifySeek = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-verifyedit"))
+	   {
+		   options.verifyEdit = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-bench"))
+	   {
+		   options.bench = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-priority") && argn + 1 < argc)
+	   {
+		   if (!strcmp(argv[argn + 1], "png"))
+		   {
+			   options.priorityOutput = PRIORITY_PNG;
+		   }
+		   else if (!strcmp(argv[argn + 1], "raw"))
+		   {
+			   options.priorityOutput = PRIORITY_RAW;
+		   }
+		   else
+		   {
+			   printf("Unknown priority format : %s\n", argv[argn + 1]);
+			   exit(0);
+		   }
+		   argn += 2;
+	   }
+	   else if (!strcmp(argv[argn], "-selftest"))
+	   {
+		   options.selfTest = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-skipunchanged"))
+	   {
+		   options.skipUnchanged = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-cache") && argn + 1 < argc)
+	   {
+		   options.cacheDirectory = argv[argn + 1];
+		   argn += 2;
+	   }
+	   else if (!strcmp(argv[argn], "-serve") && argn + 1 < argc)
+	   {
+		   options.serveAddress = argv[argn + 1];
+		   argn += 2;
+	   }
+	   else if (!strcmp(argv[argn], "-game") && argn + 1 < argc)
+	   {
+		   options.gameDirectory = argv[argn + 1];
+		   argn += 2;
+	   }
+	   else if (!strcmp(argv[argn], "-allocstats"))
+	   {
+#if !defined(AGI_ALLOC_STATS)
+		   printf("-allocstats needs a build with AGI_ALLOC_STATS defined\n");
+		   exit(0);
+#endif
+		   options.allocStats = true;
+		   argn++;
+	   }
+	   else if (!strcmp(argv[argn], "-apng") && argn + 1 < argc)
+	   {
+		   options.animationInterval = atoi(argv[argn + 1]);
+		   argn += 2;
+	   }
+	   else
+	   {
+		   printf("Unknown option : %s\n", argv[argn]);
+		   exit(0);
+	   }
+   }
+
+   if (options.selfTest)
+   {
+	   selfTest();
+	   return;
+   }
 
-   if(argc == 2 && !strcmp(argv[1], "ALL"))
+   if (options.serveAddress)
    {
+	   RenderServer server;
+	   server.serve(options.serveAddress);
+	   return;
+   }
+
+   if (options.gameDirectory && !game.open(options.gameDirectory))
+   {
+	   exit(0);
+   }
+
+   if(argc - argn == 1 && !strcmp(argv[argn], "ALL"))
+   {
+	   if (options.cacheDirectory)
+	   {
+		   renderCache.open(options.cacheDirectory);
+	   }
+
 	   for(int n = 0; n < 256; n++)
 	   {
-		   processFile(n);
+		   if (options.gameDirectory)
+		   {
+			   processGamePicture(game, n);
+		   }
+		   else
+		   {
+			   processFile(n);
+		   }
 	   }
+	   printFillStats();
+	   printSeekStats();
+	   printEditStats();
+	   printDrawStats();
+	   printAllocStats();
+	   printCacheStats();
+	   printSkipStats();
 	   return;
    }
 
-   if (argc != 2) {
-      printf("Usage: %s filename\n", argv[0]);
+   if (argc - argn != 1) {
+      printf("Usage: %s [-iterations n] [-fill queue|bitwise] [-verifyfill] [-rle]\n"
+             "       [-png lodepng|runs] [-pngstats] [-verifypng] [-verifyseek]\n"
+             "       [-verifyedit] [-bench] [-apng n] [-allocstats] [-priority png|raw]\n"
+             "       [-game directory] [-cache directory] [-skipunchanged]\n"
+             "       filename|number|ALL\n"
+             "       %s [-fill queue|bitwise] [-iterations n] [-rle] [-png lodepng|runs]\n"
+             "       -serve stdio|socketpath\n"
+             "       %s -selftest\n", argv[0], argv[0], argv[0]);
       exit(0);
    }
+   else if (options.gameDirectory) {
+      const char* problem = game.findPicture(atoi(argv[argn]), pictureData, pictureLength);
+      if (problem) {
+	      printf("Error finding picture %s : %s\n", argv[argn], problem);
+	      exit(0);
+      }
+   }
    else {
-      if ((pictureFile = fopen(argv[1], "rb")) == NULL) {
-	      printf("Error opening file : %s\n", argv[1]);
+      if (!pictureFile.map(argv[argn])) {
+	      printf("Error opening file : %s\n", argv[argn]);
 	      exit(0);
       }
+      pictureData = pictureFile.data;
+      pictureLength = pictureFile.length;
    }
 
-   long fileLen = getLength(pictureFile);
-   uint8_t* dataFile = (byte *)malloc(fileLen + 20);
-   fread(dataFile, 1, fileLen, pictureFile);
-   fclose(pictureFile);
+   unsigned offset;
+   const char* problem = validatePicture(pictureData, pictureLength, offset);
+   if (problem)
+   {
+      printf("Error in file %s : %s at offset %u\n", argv[argn], problem, offset);
+      exit(0);
+   }
    
-   PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
-   PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT);
-   upscaleDrawer.setReferenceDrawer(&baseDrawer);
+   if (options.bench)
+   {
+	   benchmarkDrawing(pictureData, pictureLength);
+   }
 
-   baseDrawer.beginDrawing(dataFile, fileLen);
-   upscaleDrawer.beginDrawing(dataFile, fileLen);
-   
-   while (baseDrawer.drawStep())
+   if (options.verifySeek)
    {
-	   upscaleDrawer.drawStep();
+	   verifySeeking(argv[argn], pictureData, pictureLength);
    }
 
-   upscaleDrawer.fillGaps();
+   if (options.verifyEdit)
+   {
+	   verifyEditing(argv[argn], pictureData, pictureLength);
+   }
+
+   PicDrawer baseDrawer(BASE_WIDTH, BASE_HEIGHT);
+   PicDrawer upscaleDrawer(UPSCALED_WIDTH, UPSCALED_HEIGHT, options.runLength, options.priorityOutput != PRIORITY_NONE);
+   configureDrawers(baseDrawer, upscaleDrawer);
 
-   DumpToPNG(baseDrawer.getPicture(), "base.png");
-   DumpToPNG(upscaleDrawer.getPicture(), "upscale.png");
+   baseDrawer.beginDrawing(pictureData, pictureLength);
+   upscaleDrawer.beginDrawing(pictureData, pictureLength);
+   drawPicture(baseDrawer, upscaleDrawer, "drawing.png");
+
+   char baseProvenance[100], provenance[100];
+   describeRender(pictureData, pictureLength, BASE_WIDTH, BASE_HEIGHT, baseProvenance, sizeof(baseProvenance));
+   describeRender(pictureData, pictureLength, UPSCALED_WIDTH, UPSCALED_HEIGHT, provenance, sizeof(provenance));
+
+   DumpToPNG(baseDrawer.getPicture(), "base.png", baseProvenance);
+   DumpToPNG(upscaleDrawer.getPicture(), "upscale.png", provenance);
+   if (options.priorityOutput != PRIORITY_NONE)
+   {
+      DumpPriority(upscaleDrawer.getPriority(), "priority", provenance);
+   }
 
-   free(dataFile);
+   printFillStats();
+   printSeekStats();
+   printEditStats();
+   printDrawStats();
 }
 